@@ -0,0 +1,48 @@
+/*
+ * benchlib.c - measurement helpers shared by the trace-replay driver and
+ *              the multithreaded benchmarks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "benchlib.h"
+
+/*
+ * read_status_kb returns a field of /proc/self/status in KiB, or 0 if it
+ * cannot be read
+ */
+size_t read_status_kb(const char *field)
+{
+    FILE *file = fopen("/proc/self/status", "r");
+    char line[256];
+    size_t kb = 0;
+
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, field, strlen(field)) == 0)
+        {
+            kb = strtoul(line + strlen(field), NULL, 10);
+            break;
+        }
+    }
+
+    fclose(file);
+    return kb;
+}
+
+/*
+ * now_seconds returns a monotonic time in seconds
+ */
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
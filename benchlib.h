@@ -0,0 +1,9 @@
+#include <stddef.h>
+
+/*
+ * benchlib holds the measurements shared by mdriver and mtbench: the
+ * resident set the kernel reports and a monotonic clock.
+ */
+
+size_t read_status_kb(const char *field);
+double now_seconds(void);
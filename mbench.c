@@ -0,0 +1,334 @@
+/*
+ * mbench.c - measures the latency of single malloc, free, realloc and
+ * calloc calls of the allocator in mm.c, and prints percentiles of each as
+ * CSV so that runs can be diffed.
+ *
+ * usage: mbench [-m max_size] [-n blocks] [-r rounds]
+ *
+ *   -m max_size  largest request size; every multiple of 16 up to it is
+ *                measured (default 1024)
+ *   -n blocks    blocks allocated per round (default 4096)
+ *   -r rounds    rounds per case; samples are pooled (default 8)
+ *
+ * A round allocates its blocks one by one and then frees them, either in
+ * reverse order (lifo) or shuffled (random). The calloc round does the
+ * same through calloc, and the realloc round grows every block by 16 bytes
+ * in the free order. A cold round starts on a fresh heap; a warm round
+ * first runs the same round once without measuring.
+ *
+ * Each output line is
+ *   op,size,order,heap,samples,p50_ns,p99_ns,p999_ns,max_ns
+ * with the cost of reading the clock already taken off.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "mm.h"
+#include "memlib.h"
+
+/* Operations measured */
+typedef enum
+{
+    OP_MALLOC,
+    OP_FREE,
+    OP_CALLOC,
+    OP_REALLOC,
+    OP_COUNT
+} op_type_t;
+
+static const char *const op_names[OP_COUNT] = {
+    "malloc", "free", "calloc", "realloc"
+};
+
+static const size_t size_step = 16;
+
+/* Timer ticks per nanosecond and the cost of one tick read, in ticks */
+static double ticks_per_ns = 1.0;
+static uint64_t timer_overhead = 0;
+
+static uint64_t ticks(void);
+static void calibrate(void);
+static void run_case(size_t size, bool random_order, bool warm,
+                     size_t blocks, unsigned rounds, void **ptrs,
+                     size_t *order, uint64_t *samples[OP_COUNT]);
+static void run_round(size_t size, size_t blocks, void **ptrs,
+                      const size_t *order, uint64_t *samples[OP_COUNT]);
+static void shuffle(size_t *order, size_t count);
+static int compare_ticks(const void *a, const void *b);
+static void report(op_type_t op, size_t size, bool random_order, bool warm,
+                   uint64_t *samples, size_t count);
+static void usage(const char *prog);
+
+int main(int argc, char **argv)
+{
+    size_t max_size = 1024;
+    size_t blocks = 4096;
+    unsigned rounds = 8;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:n:r:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'm':
+            max_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            blocks = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rounds = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (max_size < size_step || blocks == 0 || rounds == 0)
+    {
+        usage(argv[0]);
+    }
+
+    mem_init();
+    calibrate();
+
+    void **ptrs = malloc(blocks * sizeof(void *));
+    size_t *order = malloc(blocks * sizeof(size_t));
+    uint64_t *samples[OP_COUNT];
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        samples[op] = malloc((size_t)rounds * blocks * sizeof(uint64_t));
+    }
+
+    printf("op,size,order,heap,samples,p50_ns,p99_ns,p999_ns,max_ns\n");
+
+    srand(361);
+    for (size_t size = size_step; size <= max_size; size += size_step)
+    {
+        for (int random_order = 0; random_order < 2; random_order++)
+        {
+            for (int warm = 0; warm < 2; warm++)
+            {
+                run_case(size, random_order, warm, blocks, rounds, ptrs,
+                         order, samples);
+            }
+        }
+    }
+
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        free(samples[op]);
+    }
+    free(order);
+    free(ptrs);
+    mem_deinit();
+    return 0;
+}
+
+/*
+ * ticks reads the cheapest timer available: the time stamp counter on x86,
+ * and the monotonic clock in nanoseconds elsewhere
+ */
+static uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned aux;
+    return __rdtscp(&aux);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * calibrate works out the timer rate against the monotonic clock, and the
+ * smallest cost of a back-to-back pair of timer reads
+ */
+static void calibrate(void)
+{
+    struct timespec start;
+    struct timespec end;
+    uint64_t t0;
+    uint64_t t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    t0 = ticks();
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    } while ((end.tv_sec - start.tv_sec) * 1000000000
+             + (end.tv_nsec - start.tv_nsec) < 50000000);
+    t1 = ticks();
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9
+                + (end.tv_nsec - start.tv_nsec);
+    ticks_per_ns = (double)(t1 - t0) / ns;
+
+    timer_overhead = UINT64_MAX;
+    for (int i = 0; i < 10000; i++)
+    {
+        uint64_t a = ticks();
+        uint64_t b = ticks();
+        if (b - a < timer_overhead)
+        {
+            timer_overhead = b - a;
+        }
+    }
+}
+
+/*
+ * run_case measures one size, free order and heap state over several rounds
+ * and reports each operation
+ */
+static void run_case(size_t size, bool random_order, bool warm,
+                     size_t blocks, unsigned rounds, void **ptrs,
+                     size_t *order, uint64_t *samples[OP_COUNT])
+{
+    for (unsigned round = 0; round < rounds; round++)
+    {
+        uint64_t *round_samples[OP_COUNT];
+
+        for (size_t i = 0; i < blocks; i++)
+        {
+            order[i] = blocks - 1 - i;
+        }
+        if (random_order)
+        {
+            shuffle(order, blocks);
+        }
+
+        mem_reset_brk();
+        mm_init();
+
+        if (warm)
+        {
+            // The same round, unmeasured, into the last round's slots
+            for (int op = 0; op < OP_COUNT; op++)
+            {
+                round_samples[op] = samples[op] + (size_t)(rounds - 1)
+                                                  * blocks;
+            }
+            run_round(size, blocks, ptrs, order, round_samples);
+        }
+
+        for (int op = 0; op < OP_COUNT; op++)
+        {
+            round_samples[op] = samples[op] + (size_t)round * blocks;
+        }
+        run_round(size, blocks, ptrs, order, round_samples);
+    }
+
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        report(op, size, random_order, warm, samples[op],
+               (size_t)rounds * blocks);
+    }
+}
+
+/*
+ * run_round times every call of one round. The free samples come from the
+ * malloc pass; the calloc and realloc passes free their blocks untimed.
+ */
+static void run_round(size_t size, size_t blocks, void **ptrs,
+                      const size_t *order, uint64_t *samples[OP_COUNT])
+{
+    uint64_t t0;
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        t0 = ticks();
+        ptrs[i] = mm_malloc(size);
+        samples[OP_MALLOC][i] = ticks() - t0;
+        *(char *)ptrs[i] = 1;
+    }
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        void *p = ptrs[order[i]];
+        t0 = ticks();
+        mm_free(p);
+        samples[OP_FREE][i] = ticks() - t0;
+    }
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        t0 = ticks();
+        ptrs[i] = mm_calloc(1, size);
+        samples[OP_CALLOC][i] = ticks() - t0;
+    }
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        size_t k = order[i];
+        t0 = ticks();
+        ptrs[k] = mm_realloc(ptrs[k], size + size_step);
+        samples[OP_REALLOC][i] = ticks() - t0;
+    }
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        mm_free(ptrs[order[i]]);
+    }
+}
+
+/*
+ * shuffle puts count indices in a random order (Fisher-Yates)
+ */
+static void shuffle(size_t *order, size_t count)
+{
+    for (size_t i = count - 1; i > 0; i--)
+    {
+        size_t j = (size_t)rand() % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+static int compare_ticks(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * report sorts the samples of one operation and prints its percentiles
+ */
+static void report(op_type_t op, size_t size, bool random_order, bool warm,
+                   uint64_t *samples, size_t count)
+{
+    double ns[4];
+    const double ranks[3] = {0.5, 0.99, 0.999};
+
+    qsort(samples, count, sizeof(uint64_t), compare_ticks);
+
+    for (int i = 0; i < 4; i++)
+    {
+        size_t index = (i < 3) ? (size_t)(ranks[i] * (count - 1))
+                               : count - 1;
+        uint64_t t = samples[index];
+        t = (t > timer_overhead) ? t - timer_overhead : 0;
+        ns[i] = t / ticks_per_ns;
+    }
+
+    printf("%s,%zu,%s,%s,%zu,%.1f,%.1f,%.1f,%.1f\n", op_names[op], size,
+           random_order ? "random" : "lifo", warm ? "warm" : "cold", count,
+           ns[0], ns[1], ns[2], ns[3]);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m max_size] [-n blocks] [-r rounds]\n",
+            prog);
+    exit(2);
+}
@@ -0,0 +1,1001 @@
+/*
+ * mdriver.c - replays allocation traces against the allocator in mm.c and
+ * against the C library's malloc, and reports for each the throughput, the
+ * peak memory footprint and the space utilization.
+ *
+ * usage: mdriver [-c] [-n reps] [-a mm|libc] trace...
+ *
+ *   -c       check every payload: alignment, contents kept across realloc,
+ *            zeroed calloc memory, and mm_checkheap after each replay
+ *   -n reps  replay each trace reps times (default 1)
+ *   -a name  only run one allocator
+ *
+ * A trace is a text file with one operation per line. Ids name the blocks
+ * of the trace; an id may be reused once its block is freed.
+ *
+ *   # comment          lines starting with '#' and blank lines are skipped
+ *   a <id> <size>      malloc size bytes as block id
+ *   c <id> <size>      calloc size bytes as block id
+ *   r <id> <size>      realloc block id to size bytes
+ *   f <id>             free block id
+ *
+ * Binary traces recorded by libmm.so (see mm_preload.c) are read as well.
+ * Their records are put in sequence order and the addresses they name are
+ * turned into ids. Records that do not fit a consistent trace, such as
+ * frees of blocks allocated before recording started, are dropped.
+ *
+ * Each allocator runs in a child process of its own, so that neither sees
+ * the other's heap. The footprint is the growth of the child's peak resident
+ * set over the replay, and the utilization is the peak of live payload
+ * bytes in the trace over that footprint.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "benchlib.h"
+
+/* Operations of a trace */
+typedef enum
+{
+    OP_MALLOC,
+    OP_CALLOC,
+    OP_REALLOC,
+    OP_FREE
+} op_type_t;
+
+typedef struct
+{
+    op_type_t type;
+    size_t id;
+    size_t size;
+} op_t;
+
+typedef struct
+{
+    const char *name;
+    op_t *ops;
+    size_t op_count;
+    size_t id_count;     // one more than the largest id
+    size_t peak_payload; // largest sum of live block sizes
+} trace_t;
+
+/* An allocator under test */
+typedef struct
+{
+    const char *name;
+    bool (*init)(void);
+    void *(*malloc)(size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+    bool (*checkheap)(int lineno);
+} allocator_t;
+
+/* What a child reports back about one trace */
+typedef struct
+{
+    bool ok;
+    double seconds;
+    size_t footprint; // bytes
+} result_t;
+
+static bool libc_init(void);
+
+static const allocator_t allocators[] = {
+    {"mm", mm_init, mm_malloc, mm_calloc, mm_realloc, mm_free, mm_checkheap},
+    {"libc", libc_init, malloc, calloc, realloc, free, NULL},
+};
+
+#define ALLOCATOR_COUNT (sizeof(allocators) / sizeof(allocators[0]))
+
+static const size_t alignment = 16;
+static const size_t touch_stride = 4096;
+
+static const char binary_magic[8] = "MMTRACE1";
+
+/* A record of a binary trace */
+typedef struct
+{
+    char op;
+    uint64_t seq;
+    uint64_t old_ptr; // realloc only
+    uint64_t size;
+    uint64_t ptr;
+} record_t;
+
+/* Maps the addresses of live blocks to their ids; ptr 0 marks empty slots */
+typedef struct
+{
+    uint64_t ptr;
+    size_t id;
+} id_slot_t;
+
+typedef struct
+{
+    id_slot_t *slots;
+    size_t capacity; // a power of two
+    size_t count;
+    size_t *free_ids; // ids available for reuse
+    size_t free_count;
+    size_t free_capacity;
+    size_t next_id;
+} id_map_t;
+
+static bool load_trace(const char *path, trace_t *trace);
+static bool load_binary_trace(const char *path, FILE *file, trace_t *trace);
+static bool decode_records(const unsigned char *p, const unsigned char *end,
+                           record_t **records, size_t *count,
+                           size_t *capacity);
+static const unsigned char *decode_number(const unsigned char *p,
+                                          const unsigned char *end,
+                                          uint64_t *value);
+static int compare_records(const void *a, const void *b);
+static void append_op(trace_t *trace, size_t *capacity, op_type_t type,
+                      size_t id, size_t size);
+static size_t id_map_home(const id_map_t *map, uint64_t ptr);
+static id_slot_t *id_map_find(const id_map_t *map, uint64_t ptr);
+static void id_map_put(id_map_t *map, uint64_t ptr, size_t id);
+static void id_map_remove(id_map_t *map, id_slot_t *slot);
+static size_t id_take(id_map_t *map);
+static void id_release(id_map_t *map, size_t id);
+static bool run_trace(const trace_t *trace, const allocator_t *alloc,
+                      unsigned reps, bool check, result_t *result);
+static bool replay(const trace_t *trace, const allocator_t *alloc,
+                   bool check, void **blocks, size_t *sizes);
+static void fill(unsigned char *p, size_t from, size_t to, size_t id);
+static bool verify(const unsigned char *p, size_t size, size_t id);
+static void usage(const char *prog);
+
+int main(int argc, char **argv)
+{
+    bool check = false;
+    unsigned reps = 1;
+    const char *only = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "cn:a:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'c':
+            check = true;
+            break;
+        case 'n':
+            reps = (unsigned)strtoul(optarg, NULL, 10);
+            if (reps == 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'a':
+            only = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind == argc)
+    {
+        usage(argv[0]);
+    }
+
+    mem_init();
+
+    double total_ops[ALLOCATOR_COUNT] = {0};
+    double total_seconds[ALLOCATOR_COUNT] = {0};
+    double total_util[ALLOCATOR_COUNT] = {0};
+    unsigned util_count[ALLOCATOR_COUNT] = {0};
+    bool failed = false;
+
+    printf("%-24s %-6s %12s %12s %8s\n", "trace", "alloc", "ops/s",
+           "peak KiB", "util");
+
+    for (int i = optind; i < argc; i++)
+    {
+        trace_t trace;
+
+        if (!load_trace(argv[i], &trace))
+        {
+            failed = true;
+            continue;
+        }
+
+        const char *base = strrchr(trace.name, '/');
+        base = (base == NULL) ? trace.name : base + 1;
+
+        for (size_t a = 0; a < ALLOCATOR_COUNT; a++)
+        {
+            const allocator_t *alloc = &allocators[a];
+            result_t result;
+
+            if (only != NULL && strcmp(only, alloc->name) != 0)
+            {
+                continue;
+            }
+
+            if (!run_trace(&trace, alloc, reps, check, &result)
+                || !result.ok)
+            {
+                printf("%-24s %-6s %12s\n", base, alloc->name, "FAILED");
+                failed = true;
+                continue;
+            }
+
+            double ops = (double)trace.op_count * reps;
+            total_ops[a] += ops;
+            total_seconds[a] += result.seconds;
+
+            printf("%-24s %-6s %12.0f %12zu", base, alloc->name,
+                   ops / result.seconds, result.footprint / 1024);
+            if (result.footprint > 0)
+            {
+                double util = (double)trace.peak_payload / result.footprint;
+                total_util[a] += util;
+                util_count[a]++;
+                printf(" %7.1f%%\n", 100.0 * util);
+            }
+            else
+            {
+                printf(" %8s\n", "-");
+            }
+        }
+
+        free(trace.ops);
+    }
+
+    for (size_t a = 0; a < ALLOCATOR_COUNT; a++)
+    {
+        if (total_seconds[a] == 0)
+        {
+            continue;
+        }
+
+        printf("%-24s %-6s %12.0f %12s", "total", allocators[a].name,
+               total_ops[a] / total_seconds[a], "");
+        if (util_count[a] > 0)
+        {
+            printf(" %7.1f%%\n", 100.0 * total_util[a] / util_count[a]);
+        }
+        else
+        {
+            printf(" %8s\n", "-");
+        }
+    }
+
+    mem_deinit();
+    return failed ? 1 : 0;
+}
+
+/*
+ * libc_init: the C library's malloc needs no setup
+ */
+static bool libc_init(void)
+{
+    return true;
+}
+
+/*
+ * load_trace reads and validates a trace file, and works out its peak of
+ * live payload bytes. Returns false after printing an error.
+ */
+static bool load_trace(const char *path, trace_t *trace)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char magic[sizeof(binary_magic)];
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+        && memcmp(magic, binary_magic, sizeof(magic)) == 0)
+    {
+        bool ok = load_binary_trace(path, file, trace);
+        fclose(file);
+        return ok;
+    }
+    rewind(file);
+
+    size_t capacity = 1024;
+    size_t live_capacity = 0;
+    size_t *live = NULL; // size of each live id plus one, 0 when free
+    size_t payload = 0;
+    char line[256];
+    unsigned lineno = 0;
+    bool ok = true;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->name = path;
+    trace->ops = malloc(capacity * sizeof(op_t));
+
+    while (ok && fgets(line, sizeof(line), file) != NULL)
+    {
+        char type = 0;
+        size_t id;
+        size_t size = 0;
+        int fields;
+        op_t op;
+
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n')
+        {
+            continue;
+        }
+
+        fields = sscanf(line, " %c %zu %zu", &type, &id, &size);
+        switch (type)
+        {
+        case 'a':
+            op.type = OP_MALLOC;
+            break;
+        case 'c':
+            op.type = OP_CALLOC;
+            break;
+        case 'r':
+            op.type = OP_REALLOC;
+            break;
+        case 'f':
+            op.type = OP_FREE;
+            break;
+        default:
+            fields = 0;
+            break;
+        }
+
+        if (fields < 2 || (op.type != OP_FREE && fields < 3))
+        {
+            fprintf(stderr, "%s:%u: malformed operation\n", path, lineno);
+            ok = false;
+            break;
+        }
+
+        if (id >= live_capacity)
+        {
+            size_t grown = (id + 1) * 2;
+            live = realloc(live, grown * sizeof(size_t));
+            memset(live + live_capacity, 0,
+                   (grown - live_capacity) * sizeof(size_t));
+            live_capacity = grown;
+        }
+
+        // Only existing blocks may be resized or freed, and only free ids
+        // may be allocated
+        bool exists = live[id] != 0;
+        if (exists != (op.type == OP_REALLOC || op.type == OP_FREE))
+        {
+            fprintf(stderr, "%s:%u: block %zu is %s\n", path, lineno, id,
+                    exists ? "already allocated" : "not allocated");
+            ok = false;
+            break;
+        }
+
+        if (exists)
+        {
+            payload -= live[id] - 1;
+        }
+        live[id] = (op.type == OP_FREE) ? 0 : size + 1;
+        if (op.type != OP_FREE)
+        {
+            payload += size;
+        }
+        if (payload > trace->peak_payload)
+        {
+            trace->peak_payload = payload;
+        }
+        if (id >= trace->id_count)
+        {
+            trace->id_count = id + 1;
+        }
+
+        op.id = id;
+        op.size = size;
+        if (trace->op_count == capacity)
+        {
+            capacity *= 2;
+            trace->ops = realloc(trace->ops, capacity * sizeof(op_t));
+        }
+        trace->ops[trace->op_count++] = op;
+    }
+
+    fclose(file);
+    free(live);
+
+    if (!ok)
+    {
+        free(trace->ops);
+    }
+    return ok;
+}
+
+/*
+ * load_binary_trace reads the chunks of a recorded trace following its magic,
+ * orders the records and turns them into operations on ids
+ */
+static bool load_binary_trace(const char *path, FILE *file, trace_t *trace)
+{
+    size_t capacity = 0;
+    size_t record_count = 0;
+    size_t record_capacity = 0;
+    record_t *records = NULL;
+    unsigned char header[4];
+    unsigned char *chunk = NULL;
+    bool ok = true;
+
+    while (fread(header, 1, sizeof(header), file) == sizeof(header))
+    {
+        size_t length = (size_t)header[0] | (size_t)header[1] << 8
+                        | (size_t)header[2] << 16 | (size_t)header[3] << 24;
+
+        chunk = realloc(chunk, length);
+        if (fread(chunk, 1, length, file) != length
+            || !decode_records(chunk, chunk + length, &records,
+                               &record_count, &record_capacity))
+        {
+            fprintf(stderr, "%s: malformed chunk\n", path);
+            ok = false;
+            break;
+        }
+    }
+    free(chunk);
+
+    if (!ok)
+    {
+        free(records);
+        return false;
+    }
+
+    qsort(records, record_count, sizeof(record_t), compare_records);
+
+    id_map_t map = {0};
+    size_t *live = NULL; // size of each live id
+    size_t live_capacity = 0;
+    size_t payload = 0;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->name = path;
+
+    for (size_t i = 0; i < record_count; i++)
+    {
+        const record_t *record = &records[i];
+        id_slot_t *slot;
+        size_t id;
+
+        // A block whose free the trace missed gives up its address
+        if (record->ptr != 0 && (record->op != 'r'
+                                 || record->ptr != record->old_ptr))
+        {
+            slot = id_map_find(&map, record->ptr);
+            if (slot != NULL)
+            {
+                id = slot->id;
+                append_op(trace, &capacity, OP_FREE, id, 0);
+                payload -= live[id];
+                id_map_remove(&map, slot);
+                id_release(&map, id);
+            }
+        }
+
+        slot = NULL;
+        if (record->op == 'r' || record->op == 'f')
+        {
+            slot = id_map_find(&map, (record->op == 'r') ? record->old_ptr
+                                                          : record->ptr);
+        }
+
+        if (record->op == 'f' || (record->op == 'r' && record->ptr == 0
+                                  && record->size == 0))
+        {
+            // Frees of blocks allocated before recording started are dropped
+            if (slot != NULL)
+            {
+                id = slot->id;
+                append_op(trace, &capacity, OP_FREE, id, 0);
+                payload -= live[id];
+                id_map_remove(&map, slot);
+                id_release(&map, id);
+            }
+            continue;
+        }
+
+        if (record->ptr == 0)
+        {
+            // A failed call leaves everything as it was
+            continue;
+        }
+
+        if (slot != NULL)
+        {
+            id = slot->id;
+            append_op(trace, &capacity, OP_REALLOC, id, record->size);
+            payload -= live[id];
+            id_map_remove(&map, slot);
+        }
+        else
+        {
+            // Resizing a block allocated before recording started allocates
+            id = id_take(&map);
+            append_op(trace, &capacity,
+                      (record->op == 'c') ? OP_CALLOC : OP_MALLOC, id,
+                      record->size);
+        }
+        id_map_put(&map, record->ptr, id);
+
+        if (id >= live_capacity)
+        {
+            size_t grown = (id + 1) * 2;
+            live = realloc(live, grown * sizeof(size_t));
+            live_capacity = grown;
+        }
+        live[id] = record->size;
+        payload += record->size;
+        if (payload > trace->peak_payload)
+        {
+            trace->peak_payload = payload;
+        }
+    }
+
+    trace->id_count = map.next_id;
+
+    free(records);
+    free(live);
+    free(map.slots);
+    free(map.free_ids);
+    return true;
+}
+
+/*
+ * decode_records appends the records of one chunk to *records
+ */
+static bool decode_records(const unsigned char *p, const unsigned char *end,
+                           record_t **records, size_t *count,
+                           size_t *capacity)
+{
+    while (p < end)
+    {
+        record_t record = {0};
+
+        record.op = (char)*p++;
+        p = decode_number(p, end, &record.seq);
+        switch (record.op)
+        {
+        case 'a':
+        case 'c':
+            p = decode_number(p, end, &record.size);
+            p = decode_number(p, end, &record.ptr);
+            break;
+        case 'r':
+            p = decode_number(p, end, &record.old_ptr);
+            p = decode_number(p, end, &record.size);
+            p = decode_number(p, end, &record.ptr);
+            break;
+        case 'f':
+            p = decode_number(p, end, &record.ptr);
+            break;
+        default:
+            return false;
+        }
+
+        if (p == NULL)
+        {
+            return false;
+        }
+
+        if (*count == *capacity)
+        {
+            *capacity = (*capacity == 0) ? 1024 : 2 * *capacity;
+            *records = realloc(*records, *capacity * sizeof(record_t));
+        }
+        (*records)[(*count)++] = record;
+    }
+    return true;
+}
+
+/*
+ * decode_number reads an unsigned LEB128 number. Returns the byte after it,
+ * or NULL if it runs past end; p may already be NULL.
+ */
+static const unsigned char *decode_number(const unsigned char *p,
+                                          const unsigned char *end,
+                                          uint64_t *value)
+{
+    unsigned shift = 0;
+
+    *value = 0;
+    while (p != NULL && p < end && shift < 64)
+    {
+        unsigned char byte = *p++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    uint64_t x = ((const record_t *)a)->seq;
+    uint64_t y = ((const record_t *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+/*
+ * append_op adds an operation at the end of a trace
+ */
+static void append_op(trace_t *trace, size_t *capacity, op_type_t type,
+                      size_t id, size_t size)
+{
+    if (trace->op_count == *capacity)
+    {
+        *capacity = (*capacity == 0) ? 1024 : 2 * *capacity;
+        trace->ops = realloc(trace->ops, *capacity * sizeof(op_t));
+    }
+    trace->ops[trace->op_count++] = (op_t){type, id, size};
+}
+
+/*
+ * id_map_home returns the slot where the probe run for ptr starts
+ */
+static size_t id_map_home(const id_map_t *map, uint64_t ptr)
+{
+    return (size_t)((ptr * 0x9e3779b97f4a7c15ULL) >> 32)
+           & (map->capacity - 1);
+}
+
+/*
+ * id_map_find returns the slot of a live address, or NULL
+ */
+static id_slot_t *id_map_find(const id_map_t *map, uint64_t ptr)
+{
+    if (map->capacity == 0)
+    {
+        return NULL;
+    }
+
+    size_t mask = map->capacity - 1;
+    for (size_t i = id_map_home(map, ptr); map->slots[i].ptr != 0;
+         i = (i + 1) & mask)
+    {
+        if (map->slots[i].ptr == ptr)
+        {
+            return &map->slots[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * id_map_put records that the block at ptr, which is not in the map, has id.
+ * The map is kept at most half full.
+ */
+static void id_map_put(id_map_t *map, uint64_t ptr, size_t id)
+{
+    if (2 * (map->count + 1) > map->capacity)
+    {
+        id_map_t grown = *map;
+
+        grown.capacity = (map->capacity == 0) ? 1024 : 2 * map->capacity;
+        grown.slots = calloc(grown.capacity, sizeof(id_slot_t));
+        grown.count = 0;
+        for (size_t i = 0; i < map->capacity; i++)
+        {
+            if (map->slots[i].ptr != 0)
+            {
+                id_map_put(&grown, map->slots[i].ptr, map->slots[i].id);
+            }
+        }
+        free(map->slots);
+        *map = grown;
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t i = id_map_home(map, ptr);
+    while (map->slots[i].ptr != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    map->slots[i] = (id_slot_t){ptr, id};
+    map->count++;
+}
+
+/*
+ * id_map_remove empties a slot, moving later entries of its probe run back
+ * so that lookups need no tombstones
+ */
+static void id_map_remove(id_map_t *map, id_slot_t *slot)
+{
+    size_t mask = map->capacity - 1;
+    size_t hole = (size_t)(slot - map->slots);
+
+    for (size_t i = (hole + 1) & mask; map->slots[i].ptr != 0;
+         i = (i + 1) & mask)
+    {
+        size_t home = id_map_home(map, map->slots[i].ptr);
+
+        // The entry can move into the hole unless its run starts after it
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+
+    map->slots[hole].ptr = 0;
+    map->count--;
+}
+
+/*
+ * id_take hands out the most recently released id, or a new one
+ */
+static size_t id_take(id_map_t *map)
+{
+    if (map->free_count > 0)
+    {
+        return map->free_ids[--map->free_count];
+    }
+    return map->next_id++;
+}
+
+/*
+ * id_release makes the id of a freed block available again
+ */
+static void id_release(id_map_t *map, size_t id)
+{
+    if (map->free_count == map->free_capacity)
+    {
+        map->free_capacity = (map->free_capacity == 0)
+                                 ? 1024 : 2 * map->free_capacity;
+        map->free_ids = realloc(map->free_ids,
+                                map->free_capacity * sizeof(size_t));
+    }
+    map->free_ids[map->free_count++] = id;
+}
+
+/*
+ * run_trace replays a trace reps times against one allocator in a child
+ * process and collects its result
+ */
+static bool run_trace(const trace_t *trace, const allocator_t *alloc,
+                      unsigned reps, bool check, result_t *result)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        return false;
+    }
+
+    // Touched before forking, so that they count toward the baseline
+    void **blocks = calloc(trace->id_count + 1, sizeof(void *));
+    size_t *sizes = calloc(trace->id_count + 1, sizeof(size_t));
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        free(blocks);
+        free(sizes);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        result_t child = {true, 0, 0};
+
+        close(fds[0]);
+
+        // Resets the peak resident set to the current one
+        FILE *clear = fopen("/proc/self/clear_refs", "w");
+        if (clear != NULL)
+        {
+            fputs("5", clear);
+            fclose(clear);
+        }
+        size_t baseline = read_status_kb("VmRSS:");
+
+        for (unsigned rep = 0; rep < reps && child.ok; rep++)
+        {
+            if (alloc->init == mm_init)
+            {
+                mem_reset_brk();
+            }
+            if (!alloc->init())
+            {
+                fprintf(stderr, "%s: %s init failed\n", trace->name,
+                        alloc->name);
+                child.ok = false;
+                break;
+            }
+
+            double start = now_seconds();
+            child.ok = replay(trace, alloc, check, blocks, sizes);
+            child.seconds += now_seconds() - start;
+
+            if (child.ok && check && alloc->checkheap != NULL
+                && !alloc->checkheap(__LINE__))
+            {
+                fprintf(stderr, "%s: heap check failed\n", trace->name);
+                child.ok = false;
+            }
+
+            // Blocks the trace leaves allocated
+            for (size_t id = 0; id < trace->id_count; id++)
+            {
+                if (blocks[id] != NULL)
+                {
+                    alloc->free(blocks[id]);
+                    blocks[id] = NULL;
+                }
+                sizes[id] = 0;
+            }
+        }
+
+        size_t peak = read_status_kb("VmHWM:");
+        child.footprint = (peak > baseline) ? (peak - baseline) * 1024 : 0;
+
+        if (write(fds[1], &child, sizeof(child)) != sizeof(child))
+        {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    free(blocks);
+    free(sizes);
+
+    return got == (ssize_t)sizeof(*result) && WIFEXITED(status)
+           && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * replay runs every operation of a trace once. Each payload gets written:
+ * fully with an id pattern when checking, and once per touch_stride bytes
+ * otherwise, so that its pages count toward the footprint.
+ */
+static bool replay(const trace_t *trace, const allocator_t *alloc,
+                   bool check, void **blocks, size_t *sizes)
+{
+    for (size_t i = 0; i < trace->op_count; i++)
+    {
+        const op_t *op = &trace->ops[i];
+        unsigned char *p = NULL;
+        size_t old_size = sizes[op->id];
+
+        switch (op->type)
+        {
+        case OP_MALLOC:
+            p = alloc->malloc(op->size);
+            old_size = 0;
+            break;
+
+        case OP_CALLOC:
+            p = alloc->calloc(1, op->size);
+            if (check && p != NULL && !verify(p, op->size, SIZE_MAX))
+            {
+                fprintf(stderr, "%s: op %zu: calloc memory is not zero\n",
+                        trace->name, i);
+                return false;
+            }
+            old_size = 0;
+            break;
+
+        case OP_REALLOC:
+            p = alloc->realloc(blocks[op->id], op->size);
+            if (check && p != NULL
+                && !verify(p, old_size < op->size ? old_size : op->size,
+                           op->id))
+            {
+                fprintf(stderr, "%s: op %zu: realloc lost contents\n",
+                        trace->name, i);
+                return false;
+            }
+            break;
+
+        case OP_FREE:
+            if (check && !verify(blocks[op->id], old_size, op->id))
+            {
+                fprintf(stderr, "%s: op %zu: block was overwritten\n",
+                        trace->name, i);
+                return false;
+            }
+            alloc->free(blocks[op->id]);
+            blocks[op->id] = NULL;
+            sizes[op->id] = 0;
+            continue;
+        }
+
+        if (p == NULL && op->size > 0)
+        {
+            fprintf(stderr, "%s: op %zu: out of memory\n", trace->name, i);
+            return false;
+        }
+
+        if ((uintptr_t)p % alignment != 0)
+        {
+            fprintf(stderr, "%s: op %zu: payload is not aligned\n",
+                    trace->name, i);
+            return false;
+        }
+
+        if (check)
+        {
+            fill(p, (op->type == OP_REALLOC) ? old_size : 0, op->size,
+                 op->id);
+        }
+        else
+        {
+            for (size_t offset = 0; offset < op->size;
+                 offset += touch_stride)
+            {
+                p[offset] = (unsigned char)op->id;
+            }
+        }
+
+        blocks[op->id] = p;
+        sizes[op->id] = op->size;
+    }
+
+    return true;
+}
+
+/*
+ * fill writes the pattern of block id to bytes [from, to) of payload p
+ */
+static void fill(unsigned char *p, size_t from, size_t to, size_t id)
+{
+    for (size_t i = from; i < to; i++)
+    {
+        p[i] = (unsigned char)(id * 131 + i);
+    }
+}
+
+/*
+ * verify checks that the first size bytes of p hold the pattern of block
+ * id, or are zero when id is SIZE_MAX
+ */
+static bool verify(const unsigned char *p, size_t size, size_t id)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char expected = 0;
+        if (id != SIZE_MAX)
+        {
+            expected = (unsigned char)(id * 131 + i);
+        }
+        if (p[i] != expected)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-c] [-n reps] [-a mm|libc] trace...\n", prog);
+    exit(2);
+}
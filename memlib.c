@@ -0,0 +1,130 @@
+/*
+ * memlib.c - a module that simulates the memory system. Needed because it
+ *            allows us to interleave calls from the student's malloc package
+ *            with the system's malloc package in libc.
+ *
+ * The heap is one range of MAX_HEAP bytes reserved up front without swap
+ * backing, so pages are only populated once the allocator touches them. It
+ * starts at a HEAP_ALIGN boundary, so that it can be backed by huge pages.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+
+/* Largest heap mem_sbrk hands out (bytes) */
+#define MAX_HEAP ((size_t)1 << 32)
+
+/* Alignment of the heap's start: the size of an x86-64 huge page */
+#define HEAP_ALIGN ((size_t)1 << 21)
+
+/* private variables */
+static char *mem_start_brk = NULL; /* points to first byte of heap */
+static char *mem_brk = NULL;       /* points to last byte of heap plus one */
+static char *mem_max_addr = NULL;  /* largest legal heap address plus one */
+
+/*
+ * mem_init - initialize the memory system model
+ */
+void mem_init(void)
+{
+    size_t length = MAX_HEAP + HEAP_ALIGN;
+    char *start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (start == MAP_FAILED)
+    {
+        fprintf(stderr, "mem_init: reserving the heap failed: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+
+    /* Unmap the slack on either side of the aligned heap */
+    char *aligned = (char *)(((uintptr_t)start + HEAP_ALIGN - 1)
+                             & ~(uintptr_t)(HEAP_ALIGN - 1));
+    if (aligned > start)
+    {
+        munmap(start, (size_t)(aligned - start));
+    }
+    munmap(aligned + MAX_HEAP, (size_t)(start + length - (aligned + MAX_HEAP)));
+
+    mem_start_brk = aligned;
+    mem_max_addr = mem_start_brk + MAX_HEAP;
+    mem_brk = mem_start_brk;
+}
+
+/*
+ * mem_deinit - free the storage used by the memory system model
+ */
+void mem_deinit(void)
+{
+    munmap(mem_start_brk, MAX_HEAP);
+    mem_start_brk = mem_brk = mem_max_addr = NULL;
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ * The pages used so far are dropped, so the heap starts out zeroed again.
+ */
+void mem_reset_brk(void)
+{
+    if (mem_brk > mem_start_brk)
+    {
+        madvise(mem_start_brk, (size_t)(mem_brk - mem_start_brk),
+                MADV_DONTNEED);
+    }
+    mem_brk = mem_start_brk;
+}
+
+/*
+ * mem_sbrk - simple model of the sbrk function. Extends the heap by incr
+ * bytes and returns the start address of the new area. In this model, the
+ * heap cannot be shrunk.
+ */
+void *mem_sbrk(intptr_t incr)
+{
+    char *old_brk = mem_brk;
+
+    if (incr < 0 || (size_t)incr > (size_t)(mem_max_addr - mem_brk))
+    {
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+        return (void *)-1;
+    }
+    mem_brk += incr;
+    return (void *)old_brk;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo(void)
+{
+    return (void *)mem_start_brk;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi(void)
+{
+    return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize(void)
+{
+    return (size_t)(mem_brk - mem_start_brk);
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize(void)
+{
+    return (size_t)getpagesize();
+}
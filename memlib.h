@@ -0,0 +1,17 @@
+#include <unistd.h>
+#include <stdint.h>
+
+/*
+ * memlib models the heap of mm.c as one contiguous region that only grows,
+ * through mem_sbrk. Memory handed out by mem_sbrk for the first time since
+ * mem_init or mem_reset_brk reads as zero.
+ */
+
+void mem_init(void);
+void mem_deinit(void);
+void *mem_sbrk(intptr_t incr);
+void mem_reset_brk(void);
+void *mem_heap_lo(void);
+void *mem_heap_hi(void);
+size_t mem_heapsize(void);
+size_t mem_pagesize(void);
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // sched_getcpu
+
 /*
  ******************************************************************************
  *                               mm.c                                         *
@@ -37,6 +39,9 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #endif /* def DRIVER */
 
 /* You can change anything from here onward */
@@ -62,16 +67,298 @@
 #define dbg_ensures(...)
 #endif
 
+#include <stdint.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Block layouts, picked like the placement policies below, for instance with
+ * -DMM_LAYOUT=LAYOUT_COMPACT. The wide layout links free blocks with full
+ * pointers and ends every free block with a footer, so blocks take at least
+ * 32 bytes. The compact layout stores the links as 32-bit offsets from the
+ * arena's heap_start in dsize units, which covers an arena_span, and drops
+ * the footer of 16-byte free blocks: the block after one instead carries
+ * prev_min_mask, telling find_prev that the free block before it is 16 bytes
+ * long. Blocks then take at least 16 bytes.
+ */
+#define LAYOUT_WIDE 0
+#define LAYOUT_COMPACT 1
+
+#ifndef MM_LAYOUT
+#define MM_LAYOUT LAYOUT_WIDE
+#endif
+
+static const int layout = MM_LAYOUT;
+
 /* Basic constants */
 typedef uint64_t word_t;
 static const size_t wsize = sizeof(word_t);   // word and header size (bytes)
 static const size_t dsize = 2*sizeof(word_t);       // double word size (bytes)
+#if MM_LAYOUT == LAYOUT_COMPACT
+static const size_t min_block_size = 2*sizeof(word_t); // Minimum block size
+#else
 static const size_t min_block_size = 4*sizeof(word_t); // Minimum block size
+#endif
 static const size_t chunksize = 1792;    // requires (chunksize % 16 == 0)
 
+/*
+ * When no free block fits, a heap grows by at least its arena's grow_size.
+ * That starts at chunksize and doubles with every extension that comes
+ * within grow_burst_ms of the one before, up to grow_max and to a
+ * grow_share-th of the heap, so an allocation storm takes few extensions
+ * while a small or quiet heap keeps growing in small steps. An extension
+ * after a quieter spell halves it, and trimming the heap resets it.
+ */
+static const size_t grow_max = (size_t)1 << 22;
+static const size_t grow_share = 8;
+static const word_t grow_burst_ms = 100;
+
 static const word_t alloc_mask = 0x1;
 static const word_t prev_alloc_mask = 0x2;
-static const word_t size_mask = ~(word_t)0xF;
+static const word_t mmap_mask = 0x4;  // allocated block with its own mapping
+static const word_t sampled_mask = 0x8; // allocated block in the heap profile
+static const word_t prev_min_mask = (word_t)1 << 63; // see LAYOUT_COMPACT
+static const word_t size_mask = ~(word_t)0xF & ~prev_min_mask;
+
+/*
+ * Blocks of at least mmap_threshold bytes bypass the arenas. Each gets its
+ * own anonymous mapping, laid out as a word holding the lead, the block
+ * header with mmap_mask set, and the payload. The lead counts the bytes
+ * before that word, and is zero unless memalign needed a later start. free
+ * unmaps them at once and realloc resizes them with mremap, so growing one
+ * never copies the payload.
+ */
+static const size_t mmap_threshold_default = (size_t)1 << 20;
+
+/*
+ * Free blocks of at least purge_min_size bytes keep a stamp in the word after
+ * their links: the time in milliseconds they entered the free index. Once a
+ * block has stayed there for decay_ms, the whole pages inside it are given
+ * back with MADV_DONTNEED and the stamp becomes purged_stamp, recording that
+ * those pages read as zero. Such blocks are looked for when the arena frees
+ * a heap block or searches its free index for one, at most every half decay
+ * time. A free block bordering the epilogue is cut back
+ * as soon as it reaches trim_threshold bytes: arenas 1 and up lower their
+ * break, while arena 0, which cannot shrink, purges it.
+ */
+static const size_t purge_min_size = (size_t)1 << 16;
+static const size_t decay_ms_default = 10000;
+static const size_t trim_threshold_default = (size_t)1 << 17;
+static const word_t purged_stamp = ~(word_t)0;
+
+/*
+ * The heap profiler samples on average one allocation per profile_rate bytes
+ * (see mm_setopt; 0 turns it off). Each thread counts down the bytes left to
+ * its next sample, drawn from an exponential distribution so that every
+ * allocated byte is equally likely to be picked; while profiling is off the
+ * countdown just restarts at profile_recheck_bytes. A sampled allocation is
+ * always a block with a header, marked with sampled_mask, and its call stack
+ * is kept until the block is freed; realloc carries the sample over to the
+ * resized block, wherever it ends up. Stacks and samples are hashed into
+ * tables of their own, carved from profile_pool_size mappings.
+ */
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_STACK_BUCKETS 4096
+#define PROFILE_SAMPLE_BUCKETS 16384
+// profile_malloc only, as its caller may be a tail call
+#define PROFILE_SKIP_FRAMES 1
+static const int64_t profile_recheck_bytes = (int64_t)1 << 30;
+static const size_t profile_pool_size = (size_t)1 << 20;
+
+/*
+ * Free blocks are indexed by a two-level segregated fit (TLSF) structure.
+ * The first level splits block sizes into power-of-two ranges and the second
+ * level splits each range into SL_INDEX_COUNT equally sized classes. Sizes
+ * below small_block_size all share first-level index 0 and are classed in
+ * dsize steps. One bitmap per level records which lists are non-empty, so
+ * insertion, removal and search are a fixed number of bit scans.
+ */
+#define SL_INDEX_COUNT_LOG2 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + 4) // 4 == log2(dsize)
+#define FL_INDEX_MAX 47                           // largest indexed class 2^47
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 2)
+
+static const size_t small_block_size = (size_t)1 << FL_INDEX_SHIFT;
+
+/*
+ * Free blocks of at least tree_min_size bytes are kept out of the lists, in
+ * a red-black tree keyed by size, so that they are found by true best fit in
+ * O(log n). Blocks of a size already in the tree are chained off its node
+ * through their prev and next links. Each keeps its tree links in the four
+ * words after its stamp, so free_meta_size bytes at the start of a free block
+ * may hold metadata.
+ */
+#define TREE_RED 0
+#define TREE_BLACK 1
+#define TREE_CHAINED 2 // not in the tree itself but on a node's chain
+static const size_t tree_min_size = (size_t)1 << 12;
+static const size_t free_meta_size = 8*sizeof(word_t);
+
+/*
+ * Placement policies. Each is a constant, so every build is specialized for
+ * one combination and the others compile away; build with, for instance,
+ * -DMM_FIT_POLICY=FIT_BEST to pick another. Fits other than FIT_GOOD walk
+ * the lists from the request's own class upwards; as every class only holds
+ * blocks larger than those of the classes below it, they stop at the first
+ * class with a fitting block.
+ */
+#define FIT_GOOD 0  // head of the first class whose blocks all fit, O(1)
+#define FIT_FIRST 1 // first fitting block
+#define FIT_NEXT 2  // first fitting block from where the last search ended
+#define FIT_BEST 3  // smallest fitting block
+#define FIT_NTH 4   // smallest of the first fit_nth fitting blocks
+#define FIT_INDEX 5 // FIT_NTH over the size index, see below
+
+#define INSERT_LIFO 0    // freed blocks go to the head of their list
+#define INSERT_ADDRESS 1 // each list is kept sorted by address
+
+#define SPLIT_FRONT 0 // the allocation takes the front of a free block
+#define SPLIT_BACK 1  // the allocation takes the back of a free block
+
+#define COALESCE_DEFERRED 0  // small blocks wait on the quick lists
+#define COALESCE_IMMEDIATE 1 // every block is coalesced as it is freed
+
+#ifndef MM_FIT_POLICY
+#define MM_FIT_POLICY FIT_GOOD
+#endif
+#ifndef MM_INSERT_POLICY
+#define MM_INSERT_POLICY INSERT_LIFO
+#endif
+#ifndef MM_SPLIT_POLICY
+#define MM_SPLIT_POLICY SPLIT_FRONT
+#endif
+#ifndef MM_COALESCE_POLICY
+#define MM_COALESCE_POLICY COALESCE_DEFERRED
+#endif
+
+static const int fit_policy = MM_FIT_POLICY;
+static const int insert_policy = MM_INSERT_POLICY;
+static const int split_policy = MM_SPLIT_POLICY;
+static const int coalesce_policy = MM_COALESCE_POLICY;
+static const unsigned fit_nth = 18;
+
+/*
+ * Under FIT_INDEX each arena also keeps a size index: the sizes of its free
+ * blocks above min_block_size and below tree_min_size in one array, and their
+ * links, encoded as in the compact layout, in another. Entries are unordered
+ * and every size past the last entry is zero, so find_index_fit compares
+ * whole vectors of sizes against the request, 8 per AVX2 or 4 per SSE2
+ * compare, and reads no block header on the way. An indexed block keeps its
+ * position in the word after its links. Blocks of min_block_size have no room
+ * for that and are found through their list, which holds nothing else. The
+ * arrays start with index_initial entries and double into a new mapping;
+ * should that fail, the index is dropped until the heap is next created and
+ * FIT_INDEX falls back to FIT_NTH.
+ */
+static const uint32_t index_initial = 1024;
+static const uint32_t index_lanes = 8; // capacity and scans go in these steps
+
+/*
+ * The heap is split into independent arenas, each with its own heap region,
+ * free index and lock. Arena 0 grows through mem_sbrk. Arenas 1 and up each
+ * grow through an arena_span slice of one reserved address range, so the
+ * arena owning a block follows from its address. Threads are bound to an
+ * arena on their first allocation, according to arena_assignment, which is
+ * picked like the placement policies, for instance with
+ * -DMM_ARENA_POLICY=ARENA_BY_CPU.
+ */
+#define MAX_ARENAS 64
+#define ARENA_ROUND_ROBIN 0 // threads take arenas in turn
+#define ARENA_BY_CPU 1      // threads take the arena of the CPU they start on
+
+#ifndef MM_ARENA_POLICY
+#define MM_ARENA_POLICY ARENA_ROUND_ROBIN
+#endif
+
+static const int arena_assignment = MM_ARENA_POLICY;
+static const size_t arena_span = (size_t)1 << 36;        // 64 GiB each
+static const size_t arena_commit_size = (size_t)1 << 20; // mprotect step
+
+/*
+ * Built with -DMM_HUGE_PAGES=1, heaps are backed by transparent huge pages.
+ * The reserved ranges start at huge_page_size alignment and arenas 1 and up
+ * commit their slice in huge page steps. As the break of a heap grows, the
+ * huge pages it reaches are advised MADV_HUGEPAGE, except in its first
+ * huge_page_min bytes, so that a small heap stays on small pages. Purging
+ * then gives back whole huge pages only, so that it never splits one.
+ */
+#ifndef MM_HUGE_PAGES
+#define MM_HUGE_PAGES 0
+#endif
+
+static const bool huge_pages = MM_HUGE_PAGES;
+static const size_t huge_page_size = (size_t)1 << 21;
+static const size_t huge_page_min = (size_t)1 << 22;
+
+/*
+ * Requests of at most slab_max_size bytes are served from slabs instead of
+ * blocks: SLAB_SIZE chunks carved from the heap at SLAB_SIZE alignment and
+ * cut into equal slots with no per-object header. Slot sizes are multiples
+ * of dsize so payloads stay 16-byte aligned. A slab tracks its free slots in
+ * a bitmap in its own header, ahead of the slots. Each arena keeps one bit
+ * per SLAB_SIZE granule of its region, set when a slab starts there, so that
+ * free() recognizes a slot from its address alone.
+ */
+#define SLAB_CLASS_COUNT 3 // slots of 16, 32 and 48 bytes
+#define SLAB_SIZE_LOG2 14
+#define SLAB_SIZE ((size_t)1 << SLAB_SIZE_LOG2)
+#define SLAB_MAP_WORDS (SLAB_SIZE / 16 / 64) // enough for 16 byte slots
+static const size_t slab_max_size = 48;
+
+/*
+ * Each thread keeps a cache of recently freed small blocks, binned by exact
+ * block size in dsize steps from min_block_size up to tcache_max_size,
+ * followed by one bin per slab class. Cached blocks and slots stay allocated
+ * in the heap. A miss refills a bin with tcache_batch objects and an overfull
+ * bin flushes tcache_batch objects, each under a single acquisition of the
+ * owning arena's lock.
+ */
+#if MM_LAYOUT == LAYOUT_COMPACT
+// (tcache_max_size - min_block_size) / dsize + 1
+#define TCACHE_BLOCK_BIN_COUNT 32
+#else
+#define TCACHE_BLOCK_BIN_COUNT 31
+#endif
+#define TCACHE_BIN_COUNT (TCACHE_BLOCK_BIN_COUNT + SLAB_CLASS_COUNT)
+static const size_t tcache_max_size = 512;
+static const unsigned tcache_bin_max = 32;
+static const unsigned tcache_batch = 16;
+
+/*
+ * Blocks of up to quick_max_size bytes freed to an arena are not coalesced
+ * at once. They are pushed, still marked allocated, on a LIFO quick list for
+ * their exact size, from which heap_malloc takes them back without splitting.
+ * The quick lists are consolidated through coalesce when a fit search fails,
+ * before the heap grows, and once they hold quick_max_bytes.
+ */
+#if MM_LAYOUT == LAYOUT_COMPACT
+#define QUICK_BIN_COUNT 64 // (quick_max_size - min_block_size) / dsize + 1
+#else
+#define QUICK_BIN_COUNT 63
+#endif
+static const size_t quick_max_size = 1024;
+static const size_t quick_max_bytes = (size_t)1 << 16;
+
+/*
+ * Regions hand out memory by bumping a pointer through chunks they malloc,
+ * and give all of it back at once. A region's first chunk holds
+ * region_chunk_min bytes and each later one twice as many as the one before,
+ * up to region_chunk_max. Requests above a quarter of the next chunk size
+ * get a chunk of their own.
+ */
+static const size_t region_chunk_min = (size_t)1 << 14;
+static const size_t region_chunk_max = (size_t)1 << 19;
 
 typedef struct block
 {
@@ -83,6 +370,11 @@ typedef struct block
             struct block * prev;
             struct block * next;
         };
+        /* LAYOUT_COMPACT: the links as offsets, see get_next */
+        struct {
+            uint32_t prev_link;
+            uint32_t next_link;
+        };
         /*
         * We don't know how big the payload will be.  Declaring it as an
         * array of size 0 allows computing its starting address using
@@ -96,23 +388,318 @@ typedef struct block
      */
 } block_t;
 
+/* Tree links of a large free block, which follow its stamp */
+typedef struct tree_links
+{
+    block_t * left;
+    block_t * right;
+    block_t * parent;
+    word_t color;
+} tree_links_t;
+
+typedef struct slab
+{
+    /* Neighbours among the arena's slabs of this class with free slots */
+    struct slab * prev;
+    struct slab * next;
+
+    /* Bit i is set when slot i is free */
+    word_t free_map[SLAB_MAP_WORDS];
+
+    uint32_t slot_size;
+    uint32_t slot_count;
+    uint32_t free_count;
+    uint32_t slab_class;
+} slab_t;
+
+/* Slots start right after the slab header, which keeps them 16-byte aligned */
+_Static_assert(sizeof(slab_t) % 16 == 0, "slab header breaks slot alignment");
+
+typedef struct arena
+{
+    /* Serializes every access to this arena's heap and free index */
+    pthread_mutex_t lock;
+
+    /* Pointer to first block, NULL until the arena's heap is created */
+    block_t * heap_start;
+
+    /* Bit fl is set when any second-level list of class fl is non-empty */
+    word_t fl_bitmap;
+
+    /* Bit sl of sl_bitmap[fl] is set when free_lists[fl][sl] is non-empty */
+    uint32_t sl_bitmap[FL_INDEX_COUNT];
+
+    /* Heads of the segregated free lists */
+    block_t * free_lists[FL_INDEX_COUNT][SL_INDEX_COUNT];
+
+    /* FIT_NEXT: free block the next search starts from, or NULL */
+    block_t * rover;
+
+    /* Root of the tree of free blocks of at least tree_min_size bytes */
+    block_t * tree_root;
+
+    /* FIT_INDEX: sizes of the indexed blocks, followed by their links */
+    uint32_t * index_sizes;
+    uint32_t * index_links;
+    uint32_t index_count;
+    uint32_t index_capacity;
+    bool index_dropped;
+
+    /*
+     * Payloads freed by threads bound to other arenas, linked through their
+     * first word. Producers push with compare-and-swap; whoever next holds
+     * the lock takes the whole stack with one exchange and frees it.
+     */
+    void * remote_frees;
+
+    /* Freed blocks waiting to be coalesced, linked through their payload */
+    block_t * quick_lists[QUICK_BIN_COUNT];
+    size_t quick_bytes;
+
+    /* Slabs of each class that have free slots */
+    slab_t * slabs[SLAB_CLASS_COUNT];
+
+    /* Bit g is set when a slab starts at granule g of the region */
+    word_t * slab_map;
+
+    /* Position in arenas[]; arena 0 grows through mem_sbrk */
+    unsigned index;
+
+    /* Start and break of the heap region */
+    char * region_start;
+    char * region_brk;
+
+    /*
+     * Every byte from clean_mark up to region_brk is known to be zero, apart
+     * from the header, links, index slot, stamp and footer of free blocks and
+     * the epilogue. Allocation moves the mark past the allocated block.
+     */
+    char * clean_mark;
+
+    /* Time in milliseconds before which no decayed blocks are looked for */
+    word_t next_purge;
+
+    /* Arenas 1 and up: writable end of their reserved slice */
+    char * region_commit;
+
+    /* MM_HUGE_PAGES: end of the range advised MADV_HUGEPAGE */
+    char * region_huge;
+
+    /* Least bytes the heap grows by next, and when it last grew */
+    size_t grow_size;
+    word_t grow_time;
+} __attribute__((aligned(64))) arena_t;
+
+/*
+ * Counters behind mm_stats. Each thread only ever writes its own, with
+ * plain relaxed stores; mm_stats adds up those of every live thread and the
+ * totals left by threads that exited.
+ */
+typedef struct thread_stats
+{
+    word_t alloc_bytes;
+    word_t free_bytes;
+    word_t allocs[MM_STATS_CLASS_COUNT];
+    word_t frees[MM_STATS_CLASS_COUNT];
+    word_t fit_searches[MM_STATS_FIT_BUCKETS];
+    word_t heap_extensions;
+    word_t coalesce_merges;
+} thread_stats_t;
+
+/* A chunk of a region, with the memory handed out after its header */
+typedef struct region_chunk
+{
+    struct region_chunk *next; // chunk made before it
+    size_t size;               // bytes in data
+    char data[0];
+} region_chunk_t;
+
+struct mm_region
+{
+    region_chunk_t *chunks; // the chunk being bumped through first
+    char *top;              // next byte it hands out
+    char *end;
+    char *last;             // latest allocation, which mm_region_free undoes
+    size_t chunk_size;      // bytes in the next chunk
+};
+
+/* A call stack that allocated sampled blocks, with their totals */
+typedef struct profile_stack
+{
+    struct profile_stack *next; // in its hash bucket
+    word_t hash;
+    int depth;
+    void *pcs[PROFILE_MAX_DEPTH];
+
+    word_t alloc_count;
+    word_t alloc_bytes;
+    word_t live_count;
+    word_t live_bytes;
+} profile_stack_t;
+
+/* A sampled block that has not been freed yet */
+typedef struct profile_sample
+{
+    struct profile_sample *next; // in its hash bucket, or among unused ones
+    void *bp;
+    size_t size;
+    profile_stack_t *stack;
+} profile_sample_t;
+
+typedef struct tcache
+{
+    /* Singly linked stacks of cached payloads, linked by their first word */
+    void *bins[TCACHE_BIN_COUNT];
+    unsigned counts[TCACHE_BIN_COUNT];
+
+    /* heap_generation the cached blocks belong to */
+    word_t generation;
+
+    /* Whether the exit destructor is registered for this thread */
+    bool registered;
+
+    /* This thread's counters, and its neighbours among registered threads */
+    thread_stats_t stats;
+    struct tcache *prev;
+    struct tcache *next;
+
+    /* Bytes left to allocate before the next heap profile sample */
+    int64_t profile_countdown;
+    word_t profile_random;
+    bool profiling; // recording a sample, whose own allocations are skipped
+} tcache_t;
+
 
 /* Global variables */
-/* Pointer to first block */
-static block_t * heap_start = NULL;
+/* All arenas; only the first arena_count are used */
+static arena_t arenas[MAX_ARENAS];
+
+/* Number of arenas, fixed when the arenas are first created */
+static unsigned arena_count = 0;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+
+/* FIT_INDEX: whether the size index is scanned with AVX2 rather than SSE2 */
+static bool index_avx2 = false;
+
+/* Reserved address range sliced into the regions of arenas 1 and up */
+static char * arena_reserve = NULL;
+
+/* Next arena handed out under ARENA_ROUND_ROBIN */
+static unsigned next_arena = 0;
+
+/* Arena this thread allocates from, bound on its first allocation */
+static __thread arena_t * thread_arena = NULL;
+
+/* Size from which blocks are mapped individually, see mm_setopt */
+static size_t mmap_threshold = mmap_threshold_default;
+
+/* Purge tuning, see mm_setopt */
+static size_t decay_ms = decay_ms_default;
+static size_t trim_threshold = trim_threshold_default;
 
-/* Pointer to first free block */
-static block_t * free_start = NULL;
+/* Bumped by mm_init, invalidating blocks cached from an earlier heap */
+static word_t heap_generation = 0;
+
+/* This thread's cache of small blocks */
+static __thread tcache_t tcache;
+
+/* Flushes a thread's cache back to the heap when the thread exits */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/* Caches of threads that are registered, and counters of exited threads */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static tcache_t *stats_threads = NULL;
+static thread_stats_t retired_stats;
+
+/* Bytes of heap regions and mapped blocks, and their peak since mm_init */
+static size_t heap_bytes = 0;
+static size_t peak_heap_bytes = 0;
+
+/* Heap profile: sampling rate, see mm_setopt, and the tables of samples */
+static size_t profile_rate = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_stack_t *profile_stacks[PROFILE_STACK_BUCKETS];
+static profile_sample_t *profile_samples[PROFILE_SAMPLE_BUCKETS];
+static profile_sample_t *profile_unused = NULL;
+
+/* Pool mappings, chained through their first word, and the one carved from */
+static char *profile_pool_first = NULL;
+static char *profile_pool = NULL;
+static char *profile_pool_next = NULL;
+static char *profile_pool_end = NULL;
 
 bool mm_checkheap(int lineno);
 
 /* Function prototypes for internal helper routines */
-static block_t *extend_heap(size_t size);
-static void place(block_t *block, size_t asize);
-static block_t *find_fit(size_t asize);
-static block_t *coalesce(block_t *block);
+static void arenas_create(void);
+static void fork_handlers_register(void) __attribute__((constructor));
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+static arena_t *arena_get(void);
+static arena_t *arena_of(void *bp);
+static void *arena_sbrk(arena_t *arena, size_t incr);
+static void arena_advise_huge(arena_t *arena);
+static void arena_reset(arena_t *arena);
+static void remote_free_push(arena_t *arena, void *bp);
+static void remote_free_drain(arena_t *arena);
+static void arena_free(arena_t *arena, void *bp);
+static void *allocate(size_t size);
+static void *allocate_aligned(size_t size, size_t align);
+static block_t *heap_malloc_aligned(arena_t *arena, size_t asize,
+                                    size_t align);
+static block_t *place_aligned(arena_t *arena, block_t *block, size_t asize,
+                              size_t align);
+static size_t usable_size(void *bp);
+static size_t adjust_size(size_t size);
+
+// Mapped Blocks
+static size_t page_size(void);
+static bool get_mmapped(block_t *block);
+static void *mmap_malloc(size_t asize);
+static void *mmap_malloc_aligned(size_t asize, size_t align);
+static size_t mmap_lead(block_t *block);
+static void mmap_free(block_t *block);
+static void *mmap_realloc(block_t *block, size_t asize);
+
+// Purging
+static word_t now_ms(void);
+static word_t *get_stamp(block_t *block);
+static bool get_purged(block_t *block);
+static size_t purge_granule(void);
+static bool purge_range(block_t *block, char **start, char **end);
+static void purge_block(block_t *block);
+static void purge_decayed(arena_t *arena);
+static void trim_top(arena_t *arena, block_t *block);
+
+static bool init_heap(arena_t *arena);
+static block_t *heap_find(arena_t *arena, size_t asize);
+static block_t *heap_malloc(arena_t *arena, size_t asize);
+static bool heap_malloc_batch(arena_t *arena, size_t asize, size_t count,
+                              void **out);
+static int compare_addresses(const void *a, const void *b);
+static void mark_dirty(arena_t *arena, block_t *block);
+static void scrub_clean(arena_t *arena, block_t *block);
+static void heap_free(arena_t *arena, block_t *block);
+static void heap_free_now(arena_t *arena, block_t *block);
+static void *heap_realloc(arena_t *arena, block_t *block, size_t asize);
+static void shrink_block(arena_t *arena, block_t *block, size_t asize);
+static block_t *extend_heap(arena_t *arena, size_t size);
+static block_t *grow_heap(arena_t *arena, size_t asize);
+static block_t *place(arena_t *arena, block_t *block, size_t asize);
+static block_t *place_front(arena_t *arena, block_t *block, size_t asize);
+static block_t *place_back(arena_t *arena, block_t *block, size_t asize);
+static block_t *find_fit(arena_t *arena, size_t asize);
+static block_t *find_good_fit(arena_t *arena, size_t asize);
+static block_t *find_scan_fit(arena_t *arena, size_t asize, unsigned limit);
+static block_t *find_next_fit(arena_t *arena, size_t asize);
+static block_t *find_index_fit(arena_t *arena, size_t asize);
+static bool next_class(arena_t *arena, int *fl, int *sl);
+static block_t *coalesce(arena_t *arena, block_t *block);
 
 static size_t max(size_t x, size_t y);
+static size_t min(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
 static word_t pack(size_t size, bool alloc);
 
@@ -133,114 +720,316 @@ static block_t *find_next(block_t *block);
 static word_t *find_prev_footer(block_t *block);
 static block_t *find_prev(block_t *block);
 
+static block_t *get_next(arena_t *arena, block_t *block);
+static block_t *get_prev(arena_t *arena, block_t *block);
+static void set_next(arena_t *arena, block_t *block, block_t *next);
+static void set_prev(arena_t *arena, block_t *block, block_t *prev);
+static uint32_t encode_link(arena_t *arena, block_t *block);
+static block_t *decode_link(arena_t *arena, uint32_t link);
+
 // Additional Helper Functions
-static void print_blocks();
-static void print_free_list();
-static void add_to_free_list(block_t * block);
-static void update_free_start();
-static void prepend_to_free_list(block_t * block);
-static void remove_from_free_list(block_t * block);
+static void print_blocks(arena_t *arena);
+static void print_free_list(arena_t *arena);
+static int find_last_set(word_t word);
+static int find_first_set(word_t word);
+static void mapping_insert(size_t size, int *fl, int *sl);
+static size_t mapping_round_up(size_t size);
+static void prepend_to_free_list(arena_t *arena, block_t * block);
+static void remove_from_free_list(arena_t *arena, block_t * block);
 static size_t extract_prev_alloc(word_t word);
 static void set_prev_alloc(block_t * block, bool state);
 
+// Large Block Tree
+static tree_links_t *get_tree(block_t *block);
+static bool tree_red(block_t *block);
+static void tree_replace_child(arena_t *arena, block_t *parent,
+                               block_t *old, block_t *new);
+static void tree_rotate_left(arena_t *arena, block_t *x);
+static void tree_rotate_right(arena_t *arena, block_t *x);
+static void tree_insert(arena_t *arena, block_t *block);
+static void tree_remove(arena_t *arena, block_t *block);
+static void tree_remove_fixup(arena_t *arena, block_t *x, block_t *parent);
+static block_t *tree_find(arena_t *arena, size_t asize);
+static block_t *tree_lower_bound(arena_t *arena, size_t size);
+static block_t *tree_successor(block_t *node);
+
+// Size Index
+static uint32_t *get_index_slot(block_t *block);
+static bool index_grow(arena_t *arena);
+static void index_drop(arena_t *arena);
+static void index_insert(arena_t *arena, block_t *block);
+static void index_remove(arena_t *arena, block_t *block);
+static uint32_t index_scan(const uint32_t *sizes, uint32_t from, uint32_t end,
+                           uint32_t asize);
+static uint32_t index_scan_scalar(const uint32_t *sizes, uint32_t from,
+                                  uint32_t end, uint32_t asize);
+#if defined(__x86_64__)
+static uint32_t index_scan_sse2(const uint32_t *sizes, uint32_t from,
+                                uint32_t end, uint32_t asize);
+static uint32_t index_scan_avx2(const uint32_t *sizes, uint32_t from,
+                                uint32_t end, uint32_t asize)
+    __attribute__((target("avx2")));
+#endif
+
+// Slabs
+static size_t slab_class(size_t size);
+static slab_t *slab_of(arena_t *arena, void *bp);
+static slab_t *slab_create(arena_t *arena, size_t class);
+static void *slab_alloc(arena_t *arena, size_t class);
+static void slab_free(arena_t *arena, slab_t *slab, void *bp);
+static void slab_link(arena_t *arena, slab_t *slab);
+static void slab_unlink(arena_t *arena, slab_t *slab);
+static void slab_map_set(arena_t *arena, slab_t *slab, bool state);
+
+// Quick Lists
+static size_t quick_index(size_t size);
+static block_t *quick_get(arena_t *arena, size_t asize);
+static void quick_put(arena_t *arena, block_t *block);
+static void quick_consolidate(arena_t *arena);
+
+// Regions
+static bool region_grow(mm_region_t *region);
+static void *region_alloc_alone(mm_region_t *region, size_t asize);
+
+// Thread Cache
+static tcache_t *tcache_prepare(void);
+static void tcache_key_create(void);
+static void tcache_destroy(void *arg);
+static size_t tcache_index(size_t asize);
+static size_t tcache_slab_index(size_t class);
+static void *tcache_get(size_t index);
+static void *tcache_refill(size_t index);
+static void tcache_put(void *bp, size_t index);
+static void tcache_flush(tcache_t *tc, size_t index, unsigned count);
+
+// Statistics
+static thread_stats_t *stats_local(void);
+static void stat_add(word_t *counter, word_t n);
+static size_t stats_class(size_t size);
+static void stats_alloc(size_t size);
+static void stats_free(size_t size);
+static void stats_fit(unsigned candidates);
+static void stats_merge(thread_stats_t *into, thread_stats_t *from);
+static void heap_grow(size_t bytes);
+static void heap_shrink(size_t bytes);
+
+// Heap Profile
+static bool profile_tick(size_t size);
+static void *profile_malloc(size_t size, size_t align)
+    __attribute__((noinline));
+static int64_t profile_interval(tcache_t *tc, size_t rate);
+static void profile_record(void *bp, size_t size, void **pcs, int depth);
+static void profile_forget(void *bp);
+static void profile_move(void *bp, void *newbp, size_t size);
+static bool get_sampled(block_t *block);
+static profile_stack_t *profile_stack_get(void **pcs, int depth);
+static void *profile_carve(size_t size);
+static void profile_reset(void);
+static bool profile_write(int fd, const char *text, size_t length);
+
 // Heap Checks
-static bool correct_num_free_blocks();
-static bool detect_cycle();
-static bool checkAllPrevAllocBits();
-static bool no_adjacent_free_blocks();
+static bool check_arena(arena_t *arena, int line);
+static bool slabs_consistent(arena_t *arena);
+static bool quick_lists_consistent(arena_t *arena);
+static bool correct_num_free_blocks(arena_t *arena);
+static bool no_free_list_cycles(arena_t *arena);
+static bool free_index_consistent(arena_t *arena);
+static bool tree_consistent(arena_t *arena);
+static bool size_index_consistent(arena_t *arena);
+static int tree_black_height(arena_t *arena, block_t *node,
+                             block_t *parent);
+static bool checkAllPrevAllocBits(arena_t *arena);
+static bool no_adjacent_free_blocks(arena_t *arena);
 
 /*
- * mm_init initializes the memory allocator and the heap_start and free_start
- * pointers. It will run once at the beginning of execution.
+ * mm_init initializes the memory allocator: it creates the heap of arena 0
+ * and its free block index, and empties the other arenas so they start over
+ * on their next allocation. It will run once at the beginning of execution,
+ * and again whenever the driver starts over with a fresh heap; blocks cached
+ * by threads from an earlier heap are then discarded.
  * 
  */
 bool mm_init(void) 
 {
-    // Create the initial empty heap 
-    word_t *start = (word_t *)(mem_sbrk(2*wsize));
+    pthread_once(&arenas_once, arenas_create);
 
-    if (start == (void *)-1) 
+    for (unsigned i = 1; i < arena_count; i++)
     {
-        return false;
+        pthread_mutex_lock(&arenas[i].lock);
+        arena_reset(&arenas[i]);
+        pthread_mutex_unlock(&arenas[i].lock);
     }
 
-    start[0] = pack(0, true);  // Prologue footer
-    start[1] = pack(0, true);  // Epilogue header
-    
-    // Heap starts with first "block header", currently the epilogue footer
-    heap_start = (block_t *) &(start[1]);
+    // Counters describe the new heap only
+    pthread_mutex_lock(&stats_lock);
+    memset(&retired_stats, 0, sizeof(retired_stats));
+    for (tcache_t *tc = stats_threads; tc != NULL; tc = tc->next)
+    {
+        memset(&tc->stats, 0, sizeof(tc->stats));
+    }
+    pthread_mutex_unlock(&stats_lock);
+    __atomic_store_n(&heap_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&peak_heap_bytes, 0, __ATOMIC_RELAXED);
+    profile_reset();
 
-    set_prev_alloc(heap_start, true);
+    arena_t *arena = &arenas[0];
 
-    // Initialize first_start pointer 
-    free_start = NULL;
+    pthread_mutex_lock(&arena->lock);
+    arena->region_huge = NULL; // mem_init may have mapped a new region
+    bool ok = init_heap(arena);
+    heap_generation++;
+    pthread_mutex_unlock(&arena->lock);
 
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL)
+    return ok;
+}
+
+/*
+ * malloc allocates a block of some size (at least min_block_size), unless
+ * the heap profiler picks this request as a sample
+ */
+void *malloc(size_t size)
+{
+    if (profile_tick(size))
     {
-        return false;
+        return profile_malloc(size, dsize);
     }
-
-    return true;
+    return allocate(size);
 }
 
 /*
- * malloc allocates a block of some size (at least min_block_size)
+ * allocate does the work of malloc.
  * It makes sure that the size is rounded up to a multiple of 16 so that
- * the blocks are 16-byte-algined. If it fails, it will return null but 
+ * the blocks are 16-byte-algined. Tiny requests get a slab slot and small
+ * blocks, both served from the calling thread's cache without locking. If
+ * it fails, it will return null but 
  * otherwise, it should return a pointer to the newly allocated block
  */
-void *malloc(size_t size) 
+static void *allocate(size_t size)
 {
-    //dbg_requires(mm_checkheap(__LINE__));
     size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
     block_t *block;
     void *bp = NULL;
 
-    if (heap_start == NULL) // Initialize heap if it isn't initialized
+    if (size == 0) // Ignore spurious request
     {
-        mm_init();
+        return bp;
     }
 
-    if (size == 0) // Ignore spurious request
+    if (size <= slab_max_size)
     {
-        //dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+        size_t index = tcache_slab_index(slab_class(size));
+
+        bp = tcache_get(index);
+        if (bp == NULL)
+        {
+            bp = tcache_refill(index);
+        }
+
+        // Fall back to a block if no slab can be made
+        if (bp != NULL)
+        {
+            stats_alloc((slab_class(size) + 1) * dsize);
+            return bp;
+        }
     }
 
     // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
+    asize = adjust_size(size);
+    if (asize == 0) // Request too large to represent
+    {
+        return NULL;
+    }
 
-    if (asize < min_block_size) {
-        asize = min_block_size;
+    if (asize >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+    {
+        bp = mmap_malloc(asize);
+        if (bp != NULL)
+        {
+            stats_alloc(get_size(payload_to_header(bp)));
+        }
+        return bp;
     }
 
-    // Search the free list for a fit
-    block = find_fit(asize);
+    if (asize <= tcache_max_size)
+    {
+        size_t index = tcache_index(asize);
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL)
-    {  
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        if (block == NULL) // extend_heap returns an error
+        bp = tcache_get(index);
+        if (bp == NULL)
         {
-            return bp;
+            bp = tcache_refill(index);
         }
-
+        // Refills may hand out blocks a little larger than asize
+        if (bp != NULL)
+        {
+            stats_alloc(get_size(payload_to_header(bp)));
+        }
+        return bp;
     }
 
-    place(block, asize);
-    bp = header_to_payload(block);
+    arena_t *arena = arena_get();
+
+    pthread_mutex_lock(&arena->lock);
+    block = heap_malloc(arena, asize);
+    pthread_mutex_unlock(&arena->lock);
 
-    //dbg_ensures(mm_checkheap(__LINE__));
+    if (block != NULL)
+    {
+        bp = header_to_payload(block);
+        stats_alloc(get_size(block));
+    }
     return bp;
 } 
 
 /*
- * free deallocates a previously allocated block without changing its size. It
- * will be coalesced if there are other free blocks to its left or right.
+ * allocate_aligned does the work of memalign for an alignment above dsize,
+ * setting errno to ENOMEM if it fails
+ */
+static void *allocate_aligned(size_t size, size_t align)
+{
+    void *bp = NULL;
+
+    size_t asize = adjust_size(size);
+    if (asize == 0 || align > SIZE_MAX / 4 || asize > SIZE_MAX - 2 * align)
+    {
+        // Too large to represent with the slack for alignment
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (asize + align >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+    {
+        bp = mmap_malloc_aligned(asize, align);
+    }
+    else
+    {
+        arena_t *arena = arena_get();
+
+        pthread_mutex_lock(&arena->lock);
+        block_t *block = heap_malloc_aligned(arena, asize, align);
+        pthread_mutex_unlock(&arena->lock);
+
+        if (block != NULL)
+        {
+            bp = header_to_payload(block);
+        }
+    }
+
+    if (bp == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    stats_alloc(get_size(payload_to_header(bp)));
+    return bp;
+}
+
+/*
+ * free deallocates a previously allocated block without changing its size.
+ * Slab slots and small blocks go to the calling thread's cache. Others are
+ * coalesced with any free blocks to their left or right in the arena that
+ * owns them, or queued for that arena when it is not the calling thread's.
  */
 void free(void *bp)
 {
@@ -249,28 +1038,62 @@ void free(void *bp)
         return;
     }
 
+    arena_t *arena = arena_of(bp);
+
+    // Slots have no header, so rule them out before reading one
+    slab_t *slab = slab_of(arena, bp);
+    if (slab != NULL)
+    {
+        stats_free(slab->slot_size);
+        tcache_put(bp, tcache_slab_index(slab->slab_class));
+        return;
+    }
+
     block_t *block = payload_to_header(bp);
     size_t size = get_size(block);
 
-    int alloc_bit = extract_prev_alloc(block->header);
+    if (get_sampled(block))
+    {
+        profile_forget(bp);
+    }
+    stats_free(size);
 
-    write_header(block, size, false);
-    write_footer(block, size, false);
+    if (get_mmapped(block))
+    {
+        mmap_free(block);
+        return;
+    }
 
-    set_prev_alloc(block, alloc_bit);
+    if (size <= tcache_max_size)
+    {
+        tcache_put(bp, tcache_index(size));
+        return;
+    }
+
+    // Blocks owned by another arena are handed over without taking its lock
+    if (arena != arena_get())
+    {
+        remote_free_push(arena, bp);
+        return;
+    }
 
-    coalesce(block);
+    pthread_mutex_lock(&arena->lock);
+    heap_free(arena, block);
+    pthread_mutex_unlock(&arena->lock);
 }
 
 /*
- * realloc allocates a new region of memory, copies pre-existing data to that 
- * new space and frees the old block associated with the pre-existing data
+ * realloc resizes a block where it stands whenever it can: slab slots that
+ * still fit are kept, mapped blocks that stay above mmap_threshold are
+ * remapped, and heap blocks are resized by heap_realloc. Otherwise it
+ * allocates a new region of memory, copies pre-existing data to that new
+ * space and frees the old block associated with the pre-existing data.
  */
 void *realloc(void *ptr, size_t size)
 {
-    block_t *block = payload_to_header(ptr);
     size_t copysize;
     void *newptr;
+    bool sampled = false;
 
     // If size == 0, then free block and return NULL
     if (size == 0)
@@ -285,44 +1108,205 @@ void *realloc(void *ptr, size_t size)
         return malloc(size);
     }
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL)
-    {
-        return NULL;
-    }
+    arena_t *arena = arena_of(ptr);
+    slab_t *slab = slab_of(arena, ptr);
 
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
-    if(size < copysize)
+    if (slab != NULL)
     {
-        copysize = size;
+        if (size <= slab->slot_size)
+        {
+            return ptr;
+        }
     }
-    memcpy(newptr, ptr, copysize);
+    else
+    {
+        block_t *block = payload_to_header(ptr);
+        size_t asize = adjust_size(size);
+        size_t threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
 
-    // Free the old block
-    free(ptr);
+        if (asize == 0) // Request too large to represent
+        {
+            return NULL;
+        }
 
-    return newptr;
-}
+        // The sample follows the block, which may lose its mark on the way
+        sampled = get_sampled(block);
+        size_t old_size = get_size(block);
 
-/*
- * calloc is identical to malloc except that all bits are set to zero in the 
- * newly allocated space before a pointer to that block is returned 
- */
-void *calloc(size_t elements, size_t size)
+        if (get_mmapped(block))
+        {
+            if (asize >= threshold)
+            {
+                // If mremap fails, the original block is left untouched
+                newptr = mmap_realloc(block, asize);
+                if (newptr != NULL)
+                {
+                    stats_free(old_size);
+                    stats_alloc(get_size(payload_to_header(newptr)));
+                    if (sampled)
+                    {
+                        profile_move(ptr, newptr, size);
+                    }
+                }
+                return newptr;
+            }
+        }
+        else if (asize < threshold)
+        {
+            pthread_mutex_lock(&arena->lock);
+            newptr = heap_realloc(arena, block, asize);
+            pthread_mutex_unlock(&arena->lock);
+
+            if (newptr != NULL)
+            {
+                stats_free(old_size);
+                stats_alloc(get_size(payload_to_header(newptr)));
+                if (sampled)
+                {
+                    profile_move(ptr, newptr, size);
+                }
+                return newptr;
+            }
+        }
+    }
+
+    // Otherwise, proceed with reallocation. A sampled block's new home needs
+    // a header to carry the mark, which slab slots lack.
+    if (sampled)
+    {
+        newptr = allocate(max(size, slab_max_size + 1));
+    }
+    else
+    {
+        newptr = malloc(size);
+    }
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL)
+    {
+        return NULL;
+    }
+
+    // Copy the old data
+    copysize = usable_size(ptr); // gets size of old payload
+    if(size < copysize)
+    {
+        copysize = size;
+    }
+    memcpy(newptr, ptr, copysize);
+
+    // Free the old block, whose sample now belongs to the new one
+    if (sampled)
+    {
+        payload_to_header(ptr)->header &= ~sampled_mask;
+        profile_move(ptr, newptr, size);
+    }
+    free(ptr);
+
+    return newptr;
+}
+
+/*
+ * calloc is identical to malloc except that all bits are set to zero in the 
+ * newly allocated space before a pointer to that block is returned. Memory
+ * known to be zero is not cleared again: fresh mappings are skipped
+ * entirely, and heap blocks only clear what lies below the arena's clean
+ * mark plus the free block metadata left inside them.
+ */
+void *calloc(size_t elements, size_t size)
 {
     void *bp;
     size_t asize = elements * size;
 
-    if (asize/elements != size)
+    if (elements != 0 && asize/elements != size)
     {    
         // Multiplication overflowed
         return NULL;
     }
+
+    if (profile_tick(asize))
+    {
+        bp = profile_malloc(asize, dsize);
+        if (bp != NULL)
+        {
+            memset(bp, 0, asize);
+        }
+        return bp;
+    }
+
+    size_t bsize = adjust_size(asize);
+
+    if (asize > slab_max_size && bsize > tcache_max_size)
+    {
+        if (bsize >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+        {
+            bp = mmap_malloc(bsize);
+            if (bp != NULL)
+            {
+                stats_alloc(get_size(payload_to_header(bp)));
+            }
+            return bp;
+        }
+
+        arena_t *arena = arena_get();
+        char *clean_mark = NULL;
+        char *purged_start = NULL;
+        char *purged_end = NULL;
+
+        pthread_mutex_lock(&arena->lock);
+        block_t *block = heap_find(arena, bsize);
+        if (block != NULL)
+        {
+            clean_mark = arena->clean_mark;
+            if (get_purged(block))
+            {
+                purge_range(block, &purged_start, &purged_end);
+            }
+            block = place(arena, block, bsize);
+        }
+        pthread_mutex_unlock(&arena->lock);
+
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        stats_alloc(get_size(block));
+
+        // The old links, stamp and tree links always need clearing, then
+        // anything dirty
+        char *payload = (char *)header_to_payload(block);
+        char *end = (char *)block + get_size(block);
+        char *limit = (char *)min((size_t)(payload + asize),
+                                  (size_t)(end - wsize));
+        char *dirty_end = (char *)max((size_t)clean_mark,
+                                      (size_t)block + free_meta_size);
+        dirty_end = (char *)min((size_t)dirty_end, (size_t)limit);
+
+        // Purged pages, between the stamp and the footer, read as zero
+        char *clear = payload;
+        if (purged_start < purged_end)
+        {
+            char *stop = (char *)min((size_t)purged_start, (size_t)dirty_end);
+            if (clear < stop)
+            {
+                memset(clear, 0, (size_t)(stop - clear));
+            }
+            clear = (char *)max((size_t)purged_end, (size_t)clear);
+        }
+        if (clear < dirty_end)
+        {
+            memset(clear, 0, (size_t)(dirty_end - clear));
+        }
+
+        // So does the old footer when the block was not split
+        if (end - wsize < payload + asize)
+        {
+            memset(end - wsize, 0, (size_t)(payload + asize - (end - wsize)));
+        }
+
+        return payload;
+    }
     
-    bp = malloc(asize);
+    bp = allocate(asize);
     if (bp == NULL)
     {
         return NULL;
@@ -333,593 +1317,4364 @@ void *calloc(size_t elements, size_t size)
     return bp;
 }
 
-/******** The remaining content below are helper and debug routines ********/
+/*
+ * memalign allocates a block of at least size bytes whose payload is a
+ * multiple of alignment, a power of two. Alignments malloc already meets go
+ * to malloc. Otherwise the arena finds a free block with room for the
+ * aligned payload, and the slack in front of and behind it is split off as
+ * free blocks; large blocks get a mapping of their own instead. Either way
+ * the block is an ordinary one to free and realloc, though a moved block
+ * only keeps malloc's alignment.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (alignment <= dsize)
+    {
+        return malloc(size);
+    }
+
+    if (size == 0) // Ignore spurious request
+    {
+        return NULL;
+    }
 
+    if (profile_tick(size))
+    {
+        return profile_malloc(size, alignment);
+    }
+    return allocate_aligned(size, alignment);
+}
 
 /*
- * Extends the heap with given size and returns a pointer to that newly created 
- * block.
+ * posix_memalign is memalign returning an error number, which also requires
+ * alignment to be a multiple of sizeof(void *). *memptr is left as it was
+ * on failure, and so is errno.
  */
-static block_t *extend_heap(size_t size) 
+int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-    void *bp;
+    if (alignment % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
 
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1)
+    int saved_errno = errno;
+    errno = 0;
+    void *bp = memalign(alignment, size);
+    int error = errno;
+    errno = saved_errno;
+
+    if (bp == NULL && (size > 0 || error != 0))
     {
-        return NULL;
+        return (error == EINVAL) ? EINVAL : ENOMEM;
     }
-    
-    // Initialize free block header/footer 
-    block_t *block = payload_to_header(bp);
 
-    size_t alloc_bit = extract_prev_alloc(block->header);
+    *memptr = bp;
+    return 0;
+}
 
-    write_header(block, size, false);
-    write_footer(block, size, false);
+/*
+ * aligned_alloc is memalign under its C11 name
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
 
-    set_prev_alloc(block, alloc_bit);
+/*
+ * mm_setopt changes a tuning option, see the MM_OPT_ constants. Returns false
+ * for an unknown option or a value it cannot take.
+ */
+bool mm_setopt(int option, size_t value)
+{
+    switch (option)
+    {
+    case MM_OPT_MMAP_THRESHOLD:
+        if (value < page_size())
+        {
+            return false;
+        }
+        __atomic_store_n(&mmap_threshold, value, __ATOMIC_RELAXED);
+        return true;
 
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_header(block_next, 0, true);
+    case MM_OPT_DECAY_MS:
+        __atomic_store_n(&decay_ms, value, __ATOMIC_RELAXED);
+        return true;
 
-    // Coalesce in case the previous block was free
-    block = coalesce(block);
+    case MM_OPT_TRIM_THRESHOLD:
+        if (value < purge_min_size)
+        {
+            return false;
+        }
+        __atomic_store_n(&trim_threshold, value, __ATOMIC_RELAXED);
+        return true;
 
-    return block;
+    case MM_OPT_PROFILE_RATE:
+        __atomic_store_n(&profile_rate, value, __ATOMIC_RELAXED);
+
+        // Threads counting down at the old rate start over at the new one
+        pthread_mutex_lock(&stats_lock);
+        for (tcache_t *tc = stats_threads; tc != NULL; tc = tc->next)
+        {
+            int64_t countdown = (value == 0) ? profile_recheck_bytes
+                : (int64_t)min(value, (size_t)profile_recheck_bytes);
+            __atomic_store_n(&tc->profile_countdown, countdown,
+                             __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&stats_lock);
+        return true;
+
+    default:
+        return false;
+    }
 }
 
 /*
- * Coalesce determines if the blocks to the left or right (or both) of a newly 
- * freed block are also free and combines them into one block. 
+ * mm_usable_size returns how many bytes the block at ptr can hold, which
+ * may be more than were asked for. Returns 0 for NULL.
  */
-static block_t *coalesce(block_t * block) 
+size_t mm_usable_size(void *ptr)
 {
-    // fill me in
-    size_t blockSize = get_size(block);
+    return (ptr == NULL) ? 0 : usable_size(ptr);
+}
 
-    block_t * left = find_prev(block);
-    block_t * right = find_next(block);
+/*
+ * mm_malloc_batch allocates n blocks of size bytes each into out and returns
+ * how many it allocated, which is less than n only when memory runs out.
+ * Heap blocks are carved side by side from one free block, found or made
+ * under a single acquisition of the arena's lock. Slab slots and mapped
+ * blocks are allocated one by one, as malloc would.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t done = 0;
 
-    bool isLeftFree;
-    size_t leftSize;
+    if (size == 0 || n == 0)
+    {
+        return 0;
+    }
 
-    bool isRightFree;
-    size_t rightSize;
-    
-    // null pointer 
-    if (!left) {
-        leftSize = 0;
-        isLeftFree = false;
-    } else {
-        leftSize = get_size(left);
-        isLeftFree = !extract_prev_alloc(block->header);  
+    size_t asize = adjust_size(size);
+    if (size <= slab_max_size || asize == 0
+        || asize >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)
+        || n > arena_span / asize)
+    {
+        for (; done < n && (out[done] = malloc(size)) != NULL; done++)
+        {
+        }
+        return done;
     }
 
-    if (!right) {
-        rightSize = 0;
-        isRightFree = false;
-    } else {
-        isRightFree = !(get_alloc(right));
+    // A batch that runs out the profile countdown has its first block sampled
+    if (profile_tick(size * n))
+    {
+        out[0] = profile_malloc(size, dsize);
+        if (out[0] == NULL)
+        {
+            return 0;
+        }
+        done = 1;
     }
 
-    /*
-    * There are four cases: 
-    * 1) Nothing can be coalesced
-    * 2) Left can be coalesced
-    * 3) Right can be coalesced
-    * 4) Both can be coalesced
-    * 
-    */
+    if (done < n)
+    {
+        arena_t *arena = arena_get();
 
-   if (isLeftFree && isRightFree) {
+        pthread_mutex_lock(&arena->lock);
+        bool carved = heap_malloc_batch(arena, asize, n - done, out + done);
+        pthread_mutex_unlock(&arena->lock);
 
-        leftSize = get_size(left);
-        rightSize = get_size(right);
+        if (carved)
+        {
+            for (; done < n; done++)
+            {
+                stats_alloc(get_size(payload_to_header(out[done])));
+            }
+        }
+    }
 
-        // retain prev_alloc of left block
-        size_t alloc_bit = extract_prev_alloc(left->header);
+    // Without room for the whole batch at once, fall back to single blocks
+    for (; done < n && (out[done] = allocate(size)) != NULL; done++)
+    {
+    }
+    return done;
+}
 
-        // setting prev_alloc of next to reflect the current free operation
-         set_prev_alloc(find_next(right), false);
+/*
+ * mm_free_batch frees the n blocks in ptrs, leaving the array's contents
+ * undefined. The pointers are sorted by address, so that heap blocks of the
+ * calling thread's arena lying side by side are joined and freed as one:
+ * each run is coalesced with its neighbours once, and all under a single
+ * acquisition of the arena's lock. Any other pointer is freed as free would.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    arena_t *arena = arena_get();
+    size_t kept = 0;
 
-        remove_from_free_list(left);
-        remove_from_free_list(right);
+    qsort(ptrs, n, sizeof(void *), compare_addresses);
 
-        write_header(left, leftSize+blockSize+rightSize,false);
-        write_footer(left, leftSize+blockSize+rightSize,false);
+    for (size_t i = 0; i < n; i++)
+    {
+        void *bp = ptrs[i];
 
-        // Carry prev_alloc of left block
-        set_prev_alloc(left, alloc_bit);
+        if (bp == NULL)
+        {
+            continue;
+        }
+        if (arena_of(bp) != arena || slab_of(arena, bp) != NULL
+            || get_mmapped(payload_to_header(bp)))
+        {
+            free(bp);
+            continue;
+        }
 
-        prepend_to_free_list(left);
-        return left;
+        block_t *block = payload_to_header(bp);
+        if (get_sampled(block))
+        {
+            profile_forget(bp);
+        }
+        stats_free(get_size(block));
+        ptrs[kept++] = bp;
+    }
 
-   } else if (isLeftFree) {
+    if (kept == 0)
+    {
+        return;
+    }
 
-        leftSize = get_size(left);
+    pthread_mutex_lock(&arena->lock);
+    for (size_t i = 0; i < kept;)
+    {
+        block_t *run = payload_to_header(ptrs[i]);
+        size_t run_size = get_size(run);
 
-        remove_from_free_list(left);
+        for (i++; i < kept; i++)
+        {
+            block_t *block = payload_to_header(ptrs[i]);
+            if ((char *)block != (char *)run + run_size)
+            {
+                break;
+            }
+            run_size += get_size(block);
+        }
 
-        // retain prev_alloc of left block
-        size_t alloc_bit = extract_prev_alloc(left->header);
+        // The run becomes one allocated block, freed like any other
+        if (run_size != get_size(run))
+        {
+            int alloc_bit = extract_prev_alloc(run->header);
+            write_header(run, run_size, true);
+            set_prev_alloc(run, alloc_bit);
+        }
+        heap_free(arena, run);
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
 
-        write_header(left, leftSize+blockSize,false);
-        write_footer(left, leftSize+blockSize,false);
+/*
+ * mm_region_create makes an empty region, or returns NULL if out of memory.
+ * A region is not thread-safe: one thread at a time may use it.
+ */
+mm_region_t *mm_region_create(void)
+{
+    mm_region_t *region = malloc(sizeof(mm_region_t));
+    if (region == NULL)
+    {
+        return NULL;
+    }
 
-        // Carry prev_alloc of left block
-        set_prev_alloc(left, alloc_bit);
+    region->chunks = NULL;
+    region->top = NULL;
+    region->end = NULL;
+    region->last = NULL;
+    region->chunk_size = region_chunk_min;
+    return region;
+}
 
-         // setting prev_alloc of next to reflect the current free operation
-         set_prev_alloc(right, false);
+/*
+ * mm_region_alloc hands out size bytes of the region, 16-byte aligned. Most
+ * requests only bump the region's top; a new chunk is malloced when the
+ * current one runs out. The memory lives until the region is reset or
+ * destroyed and must not be passed to free or realloc.
+ */
+void *mm_region_alloc(mm_region_t *region, size_t size)
+{
+    if (size == 0 || size > SIZE_MAX - dsize) // Ignore spurious request
+    {
+        return NULL;
+    }
+
+    size_t asize = round_up(size, dsize);
+
+    if (asize > (size_t)(region->end - region->top))
+    {
+        if (asize > region->chunk_size / 4)
+        {
+            region->last = NULL;
+            return region_alloc_alone(region, asize);
+        }
+        if (!region_grow(region))
+        {
+            return NULL;
+        }
+    }
+
+    void *bp = region->top;
+    region->top += asize;
+    region->last = bp;
+    return bp;
+}
+
+/*
+ * mm_region_free gives back ptr early if it is the region's latest
+ * allocation, so that a stack-like use of the region reuses its memory.
+ * Freeing anything else is left to mm_region_reset.
+ */
+void mm_region_free(mm_region_t *region, void *ptr)
+{
+    if (ptr != NULL && ptr == region->last)
+    {
+        region->top = region->last;
+        region->last = NULL;
+    }
+}
+
+/*
+ * mm_region_reset frees everything allocated from the region at once, in
+ * time proportional to its chunks. The current chunk is kept for the
+ * allocations that follow; the others go back to the heap.
+ */
+void mm_region_reset(mm_region_t *region)
+{
+    region_chunk_t *keep = region->chunks;
+    if (keep == NULL)
+    {
+        return;
+    }
+
+    region_chunk_t *chunk = keep->next;
+    while (chunk != NULL)
+    {
+        region_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    keep->next = NULL;
+    region->top = keep->data;
+    region->end = keep->data + keep->size;
+    region->last = NULL;
+}
+
+/*
+ * mm_region_destroy frees everything allocated from the region, and the
+ * region itself
+ */
+void mm_region_destroy(mm_region_t *region)
+{
+    if (region == NULL)
+    {
+        return;
+    }
+
+    region_chunk_t *chunk = region->chunks;
+    while (chunk != NULL)
+    {
+        region_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(region);
+}
+
+/*
+ * mm_stats fills in a snapshot of the allocator's state. The counters are
+ * summed over all threads; the free index and quick lists of every arena
+ * are walked under its lock, after taking back the blocks other threads
+ * queued for it, so the call costs time proportional to the free blocks.
+ * Blocks in thread caches count at the size of their bin, read from the
+ * counts their threads keep without locking.
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    thread_stats_t sum;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&stats_lock);
+    sum = retired_stats;
+    for (tcache_t *tc = stats_threads; tc != NULL; tc = tc->next)
+    {
+        stats_merge(&sum, &tc->stats);
+
+        // Caches filled from an earlier heap are dropped on their next use
+        if (__atomic_load_n(&tc->generation, __ATOMIC_RELAXED)
+            != heap_generation)
+        {
+            continue;
+        }
+        for (size_t i = 0; i < TCACHE_BIN_COUNT; i++)
+        {
+            size_t count = __atomic_load_n(&tc->counts[i], __ATOMIC_RELAXED);
+            size_t size = (i < TCACHE_BLOCK_BIN_COUNT)
+                          ? min_block_size + i * dsize
+                          : (i - TCACHE_BLOCK_BIN_COUNT + 1) * dsize;
+
+            stats->free_blocks += count;
+            stats->cached_bytes += count * size;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    stats->live_bytes = (sum.alloc_bytes > sum.free_bytes) ?
+                        sum.alloc_bytes - sum.free_bytes : 0;
+    stats->heap_bytes = __atomic_load_n(&heap_bytes, __ATOMIC_RELAXED);
+    stats->peak_heap_bytes = __atomic_load_n(&peak_heap_bytes,
+                                             __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < MM_STATS_CLASS_COUNT; i++)
+    {
+        stats->allocs[i] = sum.allocs[i];
+        stats->frees[i] = sum.frees[i];
+    }
+    for (size_t i = 0; i < MM_STATS_FIT_BUCKETS; i++)
+    {
+        stats->fit_searches[i] = sum.fit_searches[i];
+    }
+    stats->heap_extensions = sum.heap_extensions;
+    stats->coalesce_merges = sum.coalesce_merges;
+
+    for (unsigned i = 0; i < arena_count; i++)
+    {
+        arena_t *arena = &arenas[i];
+
+        pthread_mutex_lock(&arena->lock);
+        if (arena->heap_start != NULL)
+        {
+            remote_free_drain(arena);
+        }
+        for (size_t q = 0; q < QUICK_BIN_COUNT; q++)
+        {
+            for (block_t *block = arena->quick_lists[q]; block != NULL;
+                 block = *(block_t **)block->payload)
+            {
+                stats->free_blocks++;
+                stats->cached_bytes += get_size(block);
+            }
+        }
+        for (int fl = 0; fl < FL_INDEX_COUNT && arena->heap_start != NULL;
+             fl++)
+        {
+            for (int sl = 0; sl < SL_INDEX_COUNT; sl++)
+            {
+                block_t *block;
+                for (block = arena->free_lists[fl][sl]; block != NULL;
+                     block = get_next(arena, block))
+                {
+                    size_t size = get_size(block);
+
+                    stats->free_blocks++;
+                    stats->free_bytes += size;
+                    stats->largest_free_block =
+                        max(stats->largest_free_block, size);
+                }
+            }
+        }
+        for (block_t *node = tree_lower_bound(arena, 0); node != NULL;
+             node = tree_successor(node))
+        {
+            for (block_t *block = node; block != NULL;
+                 block = get_next(arena, block))
+            {
+                size_t size = get_size(block);
+
+                stats->free_blocks++;
+                stats->free_bytes += size;
+                stats->largest_free_block =
+                    max(stats->largest_free_block, size);
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    stats->free_bytes += stats->cached_bytes;
+    if (stats->free_bytes > 0)
+    {
+        stats->fragmentation = 1.0 - (double)stats->largest_free_block
+                                     / stats->free_bytes;
+    }
+}
+
+/*
+ * mm_profile_dump writes the heap profile to path: a header with the totals
+ * and the sampling rate, one line per call stack with its live and total
+ * sampled blocks and bytes, and the process's mappings, which pprof needs to
+ * symbolize the stacks. Counts are as sampled; pprof scales them up using
+ * the rate. Returns false if the file cannot be written.
+ */
+bool mm_profile_dump(const char *path)
+{
+    // Room for four 20-digit counts with their punctuation, and an address
+    // per frame; the last byte is kept for the newline
+    char line[160 + 19 * PROFILE_MAX_DEPTH];
+    size_t limit = sizeof(line) - 1;
+    word_t totals[4] = {0, 0, 0, 0};
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // Formatting and writing do not allocate, so the lock can be held
+    pthread_mutex_lock(&profile_lock);
+    for (size_t i = 0; i < PROFILE_STACK_BUCKETS; i++)
+    {
+        for (profile_stack_t *stack = profile_stacks[i]; stack != NULL;
+             stack = stack->next)
+        {
+            totals[0] += stack->live_count;
+            totals[1] += stack->live_bytes;
+            totals[2] += stack->alloc_count;
+            totals[3] += stack->alloc_bytes;
+        }
+    }
+
+    size_t length = snprintf(
+        line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+        (size_t)totals[0], (size_t)totals[1], (size_t)totals[2],
+        (size_t)totals[3], __atomic_load_n(&profile_rate, __ATOMIC_RELAXED));
+    length = min(length, limit);
+    bool ok = profile_write(fd, line, length);
+
+    for (size_t i = 0; i < PROFILE_STACK_BUCKETS && ok; i++)
+    {
+        for (profile_stack_t *stack = profile_stacks[i];
+             stack != NULL && ok; stack = stack->next)
+        {
+            length = snprintf(line, sizeof(line), "%6zu: %8zu [%6zu: %8zu] @",
+                              (size_t)stack->live_count,
+                              (size_t)stack->live_bytes,
+                              (size_t)stack->alloc_count,
+                              (size_t)stack->alloc_bytes);
+            length = min(length, limit);
+            for (int d = 0; d < stack->depth && length < limit; d++)
+            {
+                length += snprintf(line + length, sizeof(line) - length,
+                                   " %p", stack->pcs[d]);
+                length = min(length, limit);
+            }
+            line[length++] = '\n';
+            ok = profile_write(fd, line, length);
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    // Copy the mappings, which pprof uses to find the binaries
+    const char header[] = "\nMAPPED_LIBRARIES:\n";
+    ok = ok && profile_write(fd, header, sizeof(header) - 1);
+
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0)
+    {
+        char buffer[4096];
+        ssize_t got;
+
+        while (ok && (got = read(maps, buffer, sizeof(buffer))) > 0)
+        {
+            ok = profile_write(fd, buffer, (size_t)got);
+        }
+        close(maps);
+    }
+
+    return close(fd) == 0 && ok;
+}
+
+/******** The remaining content below are helper and debug routines ********/
+
+
+/*
+ * arenas_create fixes the number of arenas at one per online CPU, up to
+ * MAX_ARENAS, and reserves the address range sliced among arenas 1 and up.
+ * If the range cannot be reserved, only arena 0 is used.
+ */
+static void arenas_create(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    index_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    arena_count = (cpus < 1) ? 1 : (unsigned)cpus;
+    if (arena_count > MAX_ARENAS)
+    {
+        arena_count = MAX_ARENAS;
+    }
+
+    if (arena_count > 1)
+    {
+        size_t length = (arena_count - 1) * arena_span;
+        size_t slack = huge_pages ? huge_page_size : 0;
+
+        void *reserve = mmap(NULL, length + slack, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                             -1, 0);
+        if (reserve == MAP_FAILED)
+        {
+            arena_count = 1;
+        }
+        else
+        {
+            // Give back the slack around a huge page aligned range
+            char *start = (char *)round_up((size_t)reserve, huge_page_size);
+            char *end = (char *)reserve + length + slack;
+            if (slack > 0 && start > (char *)reserve)
+            {
+                munmap(reserve, (size_t)(start - (char *)reserve));
+            }
+            if (slack > 0 && start + length < end)
+            {
+                munmap(start + length, (size_t)(end - (start + length)));
+            }
+            arena_reserve = (slack > 0) ? start : (char *)reserve;
+        }
+    }
+
+    for (unsigned i = 0; i < arena_count; i++)
+    {
+        arena_t *arena = &arenas[i];
+
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->index = i;
+
+        if (i > 0)
+        {
+            arena->region_start = arena_reserve + (i - 1) * arena_span;
+            arena->region_brk = arena->region_start;
+            arena->region_commit = arena->region_start;
+        }
+    }
+}
+
+/*
+ * fork_handlers_register installs the fork handlers when the allocator is
+ * loaded, outside of any allocation
+ */
+static void fork_handlers_register(void)
+{
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/*
+ * fork_prepare takes every arena lock and then the statistics lock, in the
+ * order the allocator nests them, so that no heap is forked halfway through
+ * a change
+ */
+static void fork_prepare(void)
+{
+    for (unsigned i = 0; i < arena_count; i++)
+    {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&profile_lock);
+}
+
+/*
+ * fork_parent releases the locks taken by fork_prepare
+ */
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&profile_lock);
+    pthread_mutex_unlock(&stats_lock);
+    for (unsigned i = arena_count; i > 0; i--)
+    {
+        pthread_mutex_unlock(&arenas[i - 1].lock);
+    }
+}
+
+/*
+ * fork_child releases the locks in the child, whose only thread is the one
+ * that took them. Blocks cached by the other threads of the parent are lost
+ * to the child.
+ */
+static void fork_child(void)
+{
+    fork_parent();
+}
+
+/*
+ * arena_get returns the calling thread's arena, binding the thread to one on
+ * its first call
+ */
+static arena_t *arena_get(void)
+{
+    arena_t *arena = thread_arena;
+
+    if (arena == NULL)
+    {
+        unsigned i;
+
+        pthread_once(&arenas_once, arenas_create);
+
+        if (arena_assignment == ARENA_BY_CPU)
+        {
+            int cpu = sched_getcpu();
+            i = (cpu < 0) ? 0 : (unsigned)cpu % arena_count;
+        }
+        else
+        {
+            i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED)
+                % arena_count;
+        }
+
+        arena = &arenas[i];
+        thread_arena = arena;
+    }
+
+    return arena;
+}
+
+/*
+ * arena_of returns the arena owning the block with payload bp, found from
+ * the slice of the reserved range it lies in
+ */
+static arena_t *arena_of(void *bp)
+{
+    char *p = (char *)bp;
+
+    if (arena_reserve != NULL && p >= arena_reserve
+        && p < arena_reserve + (arena_count - 1) * arena_span)
+    {
+        return &arenas[1 + (size_t)(p - arena_reserve) / arena_span];
+    }
+
+    return &arenas[0];
+}
+
+/*
+ * arena_sbrk grows an arena's heap by incr bytes and returns the old break,
+ * or (void *)-1 when the region is exhausted. Arenas 1 and up make their
+ * slice writable in arena_commit_size steps, or huge page steps under
+ * MM_HUGE_PAGES. Requires arena->lock.
+ */
+static void *arena_sbrk(arena_t *arena, size_t incr)
+{
+    if (arena->index == 0)
+    {
+        char *bp = mem_sbrk((intptr_t)incr);
+        if (bp != (void *)-1)
+        {
+            arena->region_brk = bp + incr;
+            heap_grow(incr);
+            if (huge_pages)
+            {
+                arena_advise_huge(arena);
+            }
+        }
+        return bp;
+    }
+
+    char *region_end = arena->region_start + arena_span;
+    char *old_brk = arena->region_brk;
+
+    if (incr > (size_t)(region_end - old_brk))
+    {
+        return (void *)-1;
+    }
+
+    if (old_brk + incr > arena->region_commit)
+    {
+        size_t used = (size_t)(old_brk + incr - arena->region_start);
+        size_t step = huge_pages ? huge_page_size : arena_commit_size;
+        char *commit = arena->region_start + round_up(used, step);
+
+        if (commit > region_end)
+        {
+            commit = region_end;
+        }
+
+        if (mprotect(arena->region_commit,
+                     (size_t)(commit - arena->region_commit),
+                     PROT_READ | PROT_WRITE) != 0)
+        {
+            return (void *)-1;
+        }
+        arena->region_commit = commit;
+    }
+
+    arena->region_brk = old_brk + incr;
+    heap_grow(incr);
+    if (huge_pages)
+    {
+        arena_advise_huge(arena);
+    }
+    return old_brk;
+}
+
+/*
+ * arena_advise_huge advises MADV_HUGEPAGE for the huge pages the break of
+ * the arena's region has reached, past its first huge_page_min bytes. The
+ * advice outlives resets of the heap, so each huge page is advised once.
+ * Requires arena->lock.
+ */
+static void arena_advise_huge(arena_t *arena)
+{
+    char *base = (arena->index == 0) ? (char *)mem_heap_lo()
+                                     : arena->region_start;
+    char *start = (char *)max((size_t)arena->region_huge,
+                              (size_t)base + huge_page_min);
+    char *end = (char *)round_up((size_t)arena->region_brk, huge_page_size);
+
+    if (start < end)
+    {
+        // Without transparent huge pages the heap simply stays on small pages
+        madvise(start, (size_t)(end - start), MADV_HUGEPAGE);
+        arena->region_huge = end;
+    }
+}
+
+/*
+ * arena_reset drops the heap of one of arenas 1 and up and returns its pages
+ * to the OS. The heap is recreated on the arena's next allocation.
+ * Requires arena->lock.
+ */
+static void arena_reset(arena_t *arena)
+{
+    dbg_requires(arena->index > 0);
+
+    if (arena->region_commit > arena->region_start)
+    {
+        madvise(arena->region_start,
+                (size_t)(arena->region_commit - arena->region_start),
+                MADV_DONTNEED);
+    }
+
+    arena->heap_start = NULL;
+    arena->region_brk = arena->region_start;
+    memset(arena->quick_lists, 0, sizeof(arena->quick_lists));
+    arena->quick_bytes = 0;
+    arena->rover = NULL;
+    arena->tree_root = NULL;
+    index_drop(arena);
+    __atomic_store_n(&arena->remote_frees, NULL, __ATOMIC_RELAXED);
+}
+
+/*
+ * remote_free_push queues a block for the arena that owns it. It never waits
+ * on the arena's lock.
+ */
+static void remote_free_push(arena_t *arena, void *bp)
+{
+    void *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+
+    do
+    {
+        *(void **)bp = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, bp,
+                                          true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/*
+ * remote_free_drain detaches every block queued for an arena and frees it.
+ * Taking the whole stack at once leaves no room for ABA. Requires
+ * arena->lock.
+ */
+static void remote_free_drain(arena_t *arena)
+{
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+
+    void *bp = __atomic_exchange_n(&arena->remote_frees, NULL,
+                                   __ATOMIC_ACQUIRE);
+    while (bp != NULL)
+    {
+        void *next = *(void **)bp;
+        arena_free(arena, bp);
+        bp = next;
+    }
+}
+
+/*
+ * arena_free returns a slot to its slab, or a block to the heap, of the
+ * arena that owns it. Requires arena->lock.
+ */
+static void arena_free(arena_t *arena, void *bp)
+{
+    slab_t *slab = slab_of(arena, bp);
+
+    if (slab != NULL)
+    {
+        slab_free(arena, slab, bp);
+    }
+    else
+    {
+        heap_free(arena, payload_to_header(bp));
+    }
+}
+
+/*
+ * adjust_size returns the size of the block needed for a request of size
+ * bytes, or 0 if that size cannot be represented
+ */
+static size_t adjust_size(size_t size)
+{
+    if (size > SIZE_MAX - page_size() - dsize)
+    {
+        return 0;
+    }
+
+    return max(round_up(size + wsize, dsize), min_block_size);
+}
+
+/*
+ * usable_size returns how many bytes the caller may use at bp
+ */
+static size_t usable_size(void *bp)
+{
+    slab_t *slab = slab_of(arena_of(bp), bp);
+
+    if (slab != NULL)
+    {
+        return slab->slot_size;
+    }
+    return get_payload_size(payload_to_header(bp));
+}
+
+
+/*
+ * init_heap creates the prologue and epilogue, empties the free block index
+ * and adds an initial free block of chunksize bytes. Requires arena->lock.
+ */
+static bool init_heap(arena_t *arena)
+{
+    // Create the initial empty heap 
+    word_t *start = (word_t *)(arena_sbrk(arena, 2*wsize));
+
+    if (start == (void *)-1) 
+    {
+        return false;
+    }
+
+    start[0] = pack(0, true);  // Prologue footer
+    start[1] = pack(0, true);  // Epilogue header
+    
+    // Heap starts with first "block header", currently the epilogue footer
+    arena->heap_start = (block_t *) &(start[1]);
+    arena->region_start = (char *)start;
+
+    // Arenas 1 and up sit on fresh or MADV_DONTNEED pages, which read as
+    // zero, and mem_sbrk promises the same for arena 0
+    arena->clean_mark = (char *)arena->heap_start;
+    arena->next_purge = 0;
+
+    set_prev_alloc(arena->heap_start, true);
+
+    // Empty the free block index and forget blocks queued for the old heap
+    __atomic_store_n(&arena->remote_frees, NULL, __ATOMIC_RELAXED);
+    memset(arena->slabs, 0, sizeof(arena->slabs));
+    if (arena->slab_map != NULL)
+    {
+        madvise(arena->slab_map, arena_span >> (SLAB_SIZE_LOG2 + 3),
+                MADV_DONTNEED);
+    }
+    arena->fl_bitmap = 0;
+    memset(arena->sl_bitmap, 0, sizeof(arena->sl_bitmap));
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+    memset(arena->quick_lists, 0, sizeof(arena->quick_lists));
+    arena->quick_bytes = 0;
+    arena->rover = NULL;
+    arena->tree_root = NULL;
+    index_drop(arena);
+    arena->index_dropped = false;
+    arena->grow_size = chunksize;
+    arena->grow_time = 0;
+
+    // Extend the empty heap with a free block of chunksize bytes
+    if (extend_heap(arena, chunksize) == NULL)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * heap_find finds or creates a free block of at least asize bytes in an
+ * arena, initializing the arena's heap on first use and first freeing any
+ * remotely queued blocks. Returns NULL if the heap cannot grow.
+ * Requires arena->lock.
+ */
+static block_t *heap_find(arena_t *arena, size_t asize)
+{
+    block_t *block;
+
+    if (arena->heap_start == NULL && !init_heap(arena))
+    {
+        return NULL;
+    }
+
+    // Take back blocks other threads freed since the lock was last held
+    remote_free_drain(arena);
+
+    // Purging must advance even while the arena only allocates
+    purge_decayed(arena);
+
+    // Search the free index for a fit, coalescing deferred frees if need be
+    block = find_fit(arena, asize);
+    if (block == NULL && arena->quick_bytes > 0)
+    {
+        quick_consolidate(arena);
+        block = find_fit(arena, asize);
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL)
+    {  
+        block = grow_heap(arena, asize);
+        if (block == NULL) // grow_heap returns an error
+        {
+            return NULL;
+        }
+
+    }
+
+    return block;
+}
+
+/*
+ * heap_malloc allocates a block of asize bytes in an arena, preferring one of
+ * exactly that size from the quick lists. Returns NULL if the heap cannot
+ * grow. Requires arena->lock.
+ */
+static block_t *heap_malloc(arena_t *arena, size_t asize)
+{
+    block_t *block = quick_get(arena, asize);
+    if (block != NULL)
+    {
+        return block;
+    }
+
+    block = heap_find(arena, asize);
+
+    if (block != NULL)
+    {
+        block = place(arena, block, asize);
+    }
+
+    return block;
+}
+
+/*
+ * heap_malloc_batch allocates count blocks of asize bytes in an arena, side
+ * by side in one free block of count * asize bytes, and stores their payloads
+ * in out. The last block also takes any slack the split leaves. Returns false,
+ * allocating nothing, if there is no such block and the heap cannot grow.
+ * Requires arena->lock.
+ */
+static bool heap_malloc_batch(arena_t *arena, size_t asize, size_t count,
+                              void **out)
+{
+    block_t *block = heap_find(arena, asize * count);
+    if (block == NULL)
+    {
+        return false;
+    }
+
+    block = place(arena, block, asize * count);
+
+    char *start = (char *)block;
+    size_t last = get_size(block) - (count - 1) * asize;
+
+    // The first block keeps prev_alloc, the others follow allocated blocks
+    int alloc_bit = extract_prev_alloc(block->header);
+    write_header(block, (count == 1) ? last : asize, true);
+    set_prev_alloc(block, alloc_bit);
+    out[0] = header_to_payload(block);
+
+    for (size_t i = 1; i < count; i++)
+    {
+        block = (block_t *)(start + i * asize);
+        write_header(block, (i == count - 1) ? last : asize, true);
+        set_prev_alloc(block, true);
+        out[i] = header_to_payload(block);
+    }
+
+    return true;
+}
+
+/*
+ * compare_addresses orders pointers by address, for qsort
+ */
+static int compare_addresses(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * mark_dirty moves the arena's clean mark past a block that was just
+ * allocated, since its owner may write anywhere in it
+ */
+static void mark_dirty(arena_t *arena, block_t *block)
+{
+    char *end = (char *)block + get_size(block);
+
+    if (end > arena->clean_mark)
+    {
+        arena->clean_mark = end;
+    }
+}
+
+/*
+ * scrub_clean clears whichever of a block's header, links, stamp, tree links
+ * and footer lie above the clean mark, for a block about to become the inside
+ * of a larger free block. That way only the boundaries of current free blocks
+ * are non-zero above the mark. It must run once the block is off the free
+ * index.
+ */
+static void scrub_clean(arena_t *arena, block_t *block)
+{
+    tree_links_t *tree = get_tree(block);
+    char *end = (char *)block + get_size(block);
+    word_t *words[] = {
+        &block->header,
+        (word_t *)block->payload,
+        (word_t *)block->payload + 1,
+        get_stamp(block),
+        (word_t *)((char *)block + get_size(block) - wsize),
+        (word_t *)&tree->left,
+        (word_t *)&tree->right,
+        (word_t *)&tree->parent,
+        &tree->color,
+    };
+
+    // Only blocks large enough for the tree have tree links
+    size_t count = sizeof(words) / sizeof(words[0]);
+    if (get_size(block) < tree_min_size)
+    {
+        count -= 4;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        // A compact 16-byte block ends before its stamp
+        if ((char *)words[i] >= arena->clean_mark && (char *)words[i] < end)
+        {
+            *words[i] = 0;
+        }
+    }
+}
+
+/*
+ * heap_free frees an allocated block, deferring the work to the quick lists
+ * for small blocks. Requires arena->lock.
+ */
+static void heap_free(arena_t *arena, block_t *block)
+{
+    if (coalesce_policy == COALESCE_DEFERRED
+        && get_size(block) <= quick_max_size)
+    {
+        quick_put(arena, block);
+        return;
+    }
+
+    heap_free_now(arena, block);
+}
+
+/*
+ * heap_free_now marks an allocated block free and coalesces it with its
+ * neighbours. Requires arena->lock.
+ */
+static void heap_free_now(arena_t *arena, block_t *block)
+{
+    size_t size = get_size(block);
+
+    int alloc_bit = extract_prev_alloc(block->header);
+
+    write_header(block, size, false);
+    write_footer(block, size, false);
+
+    set_prev_alloc(block, alloc_bit);
+
+    block = coalesce(arena, block);
+
+    trim_top(arena, block);
+    purge_decayed(arena);
+}
+
+/*
+ * heap_realloc resizes an allocated heap block to asize bytes without
+ * leaving its neighbourhood. In order of preference it shrinks the block,
+ * grows it into a free right neighbour (first extending the heap if that
+ * reaches the epilogue), or slides the payload left into a free left
+ * neighbour. Returns the payload, or NULL with the block untouched if none
+ * applies. Requires arena->lock.
+ */
+static void *heap_realloc(arena_t *arena, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+
+    if (asize <= csize)
+    {
+        shrink_block(arena, block, asize);
+        return header_to_payload(block);
+    }
+
+    block_t *right = find_next(block);
+    size_t rsize = get_alloc(right) ? 0 : get_size(right);
+
+    // At the top of the heap, grow the heap under the block
+    block_t *after = (rsize > 0) ? find_next(right) : right;
+    if (csize + rsize < asize
+        && (char *)after == arena->region_brk - wsize)
+    {
+        if (grow_heap(arena, asize - csize - rsize) == NULL)
+        {
+            return NULL;
+        }
+        right = find_next(block);
+        rsize = get_size(right);
+    }
+
+    if (csize + rsize >= asize)
+    {
+        remove_from_free_list(arena, right);
+
+        // retaining prev_alloc for the grown block
+        int alloc_bit = extract_prev_alloc(block->header);
+
+        write_header(block, csize + rsize, true);
+        set_prev_alloc(block, alloc_bit);
+        set_prev_alloc(find_next(block), true);
+        mark_dirty(arena, block);
+
+        shrink_block(arena, block, asize);
+        return header_to_payload(block);
+    }
+
+    if (!extract_prev_alloc(block->header))
+    {
+        block_t *left = find_prev(block);
+        size_t lsize = get_size(left);
+
+        if (lsize + csize + rsize >= asize)
+        {
+            remove_from_free_list(arena, left);
+            if (rsize > 0)
+            {
+                remove_from_free_list(arena, right);
+            }
+
+            // retaining prev_alloc for the left block
+            int alloc_bit = extract_prev_alloc(left->header);
+
+            write_header(left, lsize + csize + rsize, true);
+            set_prev_alloc(left, alloc_bit);
+            set_prev_alloc(find_next(left), true);
+            mark_dirty(arena, left);
+
+            // The regions overlap whenever the left block is small
+            memmove(header_to_payload(left), header_to_payload(block),
+                    csize - wsize);
+
+            shrink_block(arena, left, asize);
+            return header_to_payload(left);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * shrink_block cuts an allocated block down to asize bytes when the rest
+ * can form a free block, which is then coalesced with its right neighbour.
+ * Requires arena->lock.
+ */
+static void shrink_block(arena_t *arena, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+
+    if ((csize - asize) < min_block_size)
+    {
+        return;
+    }
+
+    // retaining prev_alloc for the shrunk block
+    int alloc_bit = extract_prev_alloc(block->header);
+
+    write_header(block, asize, true);
+    set_prev_alloc(block, alloc_bit);
+
+    block_t *block_next = find_next(block);
+    write_header(block_next, csize - asize, false);
+    write_footer(block_next, csize - asize, false);
+    set_prev_alloc(block_next, true);
+    coalesce(arena, block_next);
+}
+
+/*
+ * heap_malloc_aligned is heap_malloc for blocks whose payload must start at
+ * a multiple of align, a power of two above dsize. The fit is searched with
+ * room for the largest leading slack place_aligned may cut off. Otherwise
+ * the heap grows just enough for the aligned block to end at the new top.
+ * Requires arena->lock.
+ */
+static block_t *heap_malloc_aligned(arena_t *arena, size_t asize,
+                                    size_t align)
+{
+    size_t search = asize + align + min_block_size;
+    block_t *block;
+
+    if (arena->heap_start == NULL && !init_heap(arena))
+    {
+        return NULL;
+    }
+
+    remote_free_drain(arena);
+
+    block = find_fit(arena, search);
+    if (block == NULL && arena->quick_bytes > 0)
+    {
+        quick_consolidate(arena);
+        block = find_fit(arena, search);
+    }
+    if (block == NULL)
+    {
+        // The new block starts at the epilogue, or at a free block before it
+        block_t *top = (block_t *)(arena->region_brk - wsize);
+        if (!extract_prev_alloc(top->header))
+        {
+            top = find_prev(top);
+        }
+
+        char *payload = (char *)header_to_payload(top);
+        char *aligned = (char *)round_up((size_t)payload, align);
+        while (aligned != payload
+               && (size_t)(aligned - payload) < min_block_size)
+        {
+            aligned += align;
+        }
+
+        // Bytes the aligned block reaches past the current epilogue
+        char *end = aligned - wsize + asize;
+        char *epilogue = arena->region_brk - wsize;
+        size_t extendsize = (end > epilogue) ? (size_t)(end - epilogue) : 0;
+
+        block = extend_heap(arena, max(extendsize, min_block_size));
+        if (block == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    return place_aligned(arena, block, asize, align);
+}
+
+/*
+ * place_aligned allocates asize bytes of a free block so that the payload
+ * is aligned to align. Leading slack becomes a free block of its own, at
+ * least min_block_size long, and place splits off the trailing slack.
+ * Returns the allocated block.
+ */
+static block_t *place_aligned(arena_t *arena, block_t *block, size_t asize,
+                              size_t align)
+{
+    char *payload = (char *)header_to_payload(block);
+    char *aligned = (char *)round_up((size_t)payload, align);
+
+    // The slack must be able to hold a free block of its own
+    while (aligned != payload && (size_t)(aligned - payload) < min_block_size)
+    {
+        aligned += align;
+    }
+
+    size_t lead = (size_t)(aligned - payload);
+
+    if (lead > 0)
+    {
+        size_t csize = get_size(block);
+        dbg_requires(csize >= lead + asize);
+
+        remove_from_free_list(arena, block);
+
+        // retaining prev_alloc for the leading block
+        int alloc_bit = extract_prev_alloc(block->header);
+
+        write_header(block, lead, false);
+        write_footer(block, lead, false);
+        set_prev_alloc(block, alloc_bit);
+        prepend_to_free_list(arena, block);
+
+        block_t *block_next = find_next(block);
+        write_header(block_next, csize - lead, false);
+        write_footer(block_next, csize - lead, false);
+        set_prev_alloc(block_next, false);
+        prepend_to_free_list(arena, block_next);
+
+        block = block_next;
+    }
+
+    // The aligned payload is at the front, whatever the split policy
+    return place_front(arena, block, asize);
+}
+
+
+/*
+ * Extends the heap with given size and returns a pointer to that newly created 
+ * block.
+ */
+static block_t *extend_heap(arena_t *arena, size_t size) 
+{
+    void *bp;
+
+    // Allocate an even number of words to maintain alignment
+    size = round_up(size, dsize);
+    if ((bp = arena_sbrk(arena, size)) == (void *)-1)
+    {
+        return NULL;
+    }
+    
+    stat_add(&stats_local()->heap_extensions, 1);
+
+    // Initialize free block header/footer 
+    block_t *block = payload_to_header(bp);
+
+    size_t alloc_bit = extract_prev_alloc(block->header);
+
+    write_header(block, size, false);
+    write_footer(block, size, false);
+
+    set_prev_alloc(block, alloc_bit);
+
+    // Create new epilogue header
+    block_t *block_next = find_next(block);
+    write_header(block_next, 0, true);
+
+    // Coalesce in case the previous block was free
+    block = coalesce(arena, block);
+
+    return block;
+}
+
+/*
+ * grow_heap extends the heap by asize bytes, or by the arena's grow_size if
+ * that is more and the region has room for it, and then adapts grow_size to
+ * the pace of growth. Returns the new free block, or NULL if the heap
+ * cannot grow. Requires arena->lock.
+ */
+static block_t *grow_heap(arena_t *arena, size_t asize)
+{
+    block_t *block = extend_heap(arena, max(asize, arena->grow_size));
+    if (block == NULL && asize < arena->grow_size)
+    {
+        block = extend_heap(arena, asize);
+    }
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    word_t now = now_ms();
+    size_t heap = (size_t)(arena->region_brk - arena->region_start);
+    size_t next = (now - arena->grow_time < grow_burst_ms)
+                  ? 2 * arena->grow_size : arena->grow_size / 2;
+
+    next = min(next, grow_max);
+    next = min(next, (heap / grow_share) & ~(dsize - 1));
+    arena->grow_size = max(next, chunksize);
+    arena->grow_time = now;
+
+    return block;
+}
+
+/*
+ * Coalesce determines if the blocks to the left or right (or both) of a newly 
+ * freed block are also free and combines them into one block. 
+ */
+static block_t *coalesce(arena_t *arena, block_t * block) 
+{
+    // fill me in
+    size_t blockSize = get_size(block);
+
+    block_t * left = NULL;
+    block_t * right = find_next(block);
+
+    bool isLeftFree;
+    size_t leftSize;
+
+    bool isRightFree;
+    size_t rightSize;
+    
+    // Allocated blocks carry no footer, so only follow the previous footer
+    // once the prev_alloc bit says the left block is free
+    isLeftFree = !extract_prev_alloc(block->header);
+    if (isLeftFree) {
+        left = find_prev(block);
+    }
+
+    if (!right) {
+        rightSize = 0;
+        isRightFree = false;
+    } else {
+        isRightFree = !(get_alloc(right));
+    }
+
+    /*
+    * There are four cases: 
+    * 1) Nothing can be coalesced
+    * 2) Left can be coalesced
+    * 3) Right can be coalesced
+    * 4) Both can be coalesced
+    * 
+    */
+
+   if (isLeftFree && isRightFree) {
+
+        leftSize = get_size(left);
+        rightSize = get_size(right);
+
+        // retain prev_alloc of left block
+        size_t alloc_bit = extract_prev_alloc(left->header);
+
+        // setting prev_alloc of next to reflect the current free operation
+         set_prev_alloc(find_next(right), false);
+
+        remove_from_free_list(arena, left);
+        remove_from_free_list(arena, right);
+        stat_add(&stats_local()->coalesce_merges, 2);
+        scrub_clean(arena, left);
+        scrub_clean(arena, block);
+        scrub_clean(arena, right);
+
+        write_header(left, leftSize+blockSize+rightSize,false);
+        write_footer(left, leftSize+blockSize+rightSize,false);
+
+        // Carry prev_alloc of left block
+        set_prev_alloc(left, alloc_bit);
+
+        prepend_to_free_list(arena, left);
+        return left;
+
+   } else if (isLeftFree) {
+
+        leftSize = get_size(left);
+
+        remove_from_free_list(arena, left);
+        stat_add(&stats_local()->coalesce_merges, 1);
+
+        // retain prev_alloc of left block
+        size_t alloc_bit = extract_prev_alloc(left->header);
+
+        scrub_clean(arena, left);
+        scrub_clean(arena, block);
+
+        write_header(left, leftSize+blockSize,false);
+        write_footer(left, leftSize+blockSize,false);
+
+        // Carry prev_alloc of left block
+        set_prev_alloc(left, alloc_bit);
+
+         // setting prev_alloc of next to reflect the current free operation
+         set_prev_alloc(right, false);
+
+        prepend_to_free_list(arena, left);
+        return left;
+
+   } else if(isRightFree) {
+
+        rightSize = get_size(right);
+
+        // setting prev_alloc of next to reflect the current free operation
+        set_prev_alloc(find_next(right), false);
+
+        remove_from_free_list(arena, right);
+        stat_add(&stats_local()->coalesce_merges, 1);
+
+        // retain prev_alloc of current block
+        size_t alloc_bit = extract_prev_alloc(block->header);
+
+        scrub_clean(arena, block);
+        scrub_clean(arena, right);
+
+        write_header(block, blockSize+rightSize,false);
+        write_footer(block, blockSize+rightSize,false);
+
+        // Carry prev_alloc of current block
+        set_prev_alloc(block, alloc_bit);
+
+        prepend_to_free_list(arena, block);
+        return block;
+
+   } else {
+        
+        prepend_to_free_list(arena, block);
+
+         // setting prev_alloc of next to reflect the current free operation
+         set_prev_alloc(right, false);
+         
+
+        return block;
+   }
+   
+}
+
+/*
+ * place allocates asize bytes of a free block, splitting it according to
+ * split_policy, and returns the allocated block
+ */
+static block_t *place(arena_t *arena, block_t *block, size_t asize)
+{
+    if (split_policy == SPLIT_BACK)
+    {
+        return place_back(arena, block, asize);
+    }
+    return place_front(arena, block, asize);
+}
+
+/*
+ * place_front writes to the block passes as the parameter. If the payload
+ * leaves space within that block, the rest of the block is split and marked
+ * as unallocated. Returns the block.
+ */
+static block_t *place_front(arena_t *arena, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+
+    if ((csize - asize) >= min_block_size)
+    {
+        bool purged = get_purged(block);
+
+        // The index is keyed by size, so unlink before the header changes
+        remove_from_free_list(arena, block);
+
+        // retaining prev_alloc for the first block
+        int alloc_bit = extract_prev_alloc(block->header);
+
+        write_header(block, asize, true);
+        //write_footer(block, asize, true);
+
+        // carry prev_alloc for first block
+        set_prev_alloc(block, alloc_bit);
+
+        block_t *block_next;
+        block_next = find_next(block);
+        write_header(block_next, csize-asize, false);
+        write_footer(block_next, csize-asize, false);
+        set_prev_alloc(block_next, true);
+        mark_dirty(arena, block);
+        block_next = coalesce(arena, block_next);
+
+        // A remainder cut from purged pages has its own pages purged as well
+        if (purged && get_size(block_next) == csize - asize
+            && get_size(block_next) >= purge_min_size)
+        {
+            *get_stamp(block_next) = purged_stamp;
+        }
+    
+    }
+    else
+    { 
+        remove_from_free_list(arena, block);
+
+        // retaining prev_alloc for the current block
+        int alloc_bit = extract_prev_alloc(block->header);
+
+        write_header(block, csize, true);
+        //write_footer(block, csize, true);
+
+        // carry prev_alloc for current block
+        set_prev_alloc(block, alloc_bit);
+
+        // setting prev_alloc of next to reflect the current free operation
+         set_prev_alloc(find_next(block), true);
+        mark_dirty(arena, block);
+    }
+
+    return block;
+}
+
+/*
+ * place_back allocates the last asize bytes of a free block and leaves the
+ * front in the free index, so that the free block keeps its place and
+ * nothing has to be coalesced. Returns the allocated block.
+ */
+static block_t *place_back(arena_t *arena, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+
+    if ((csize - asize) < min_block_size)
+    {
+        return place_front(arena, block, asize);
+    }
+
+    bool purged = get_purged(block);
+
+    // The index is keyed by size, so unlink before the header changes
+    remove_from_free_list(arena, block);
+
+    // retaining prev_alloc for the front block
+    int alloc_bit = extract_prev_alloc(block->header);
+
+    write_header(block, csize - asize, false);
+    write_footer(block, csize - asize, false);
+    set_prev_alloc(block, alloc_bit);
+    prepend_to_free_list(arena, block);
+
+    // The new footer lies past the front's purge range, which stays clean
+    if (purged && get_size(block) >= purge_min_size)
+    {
+        *get_stamp(block) = purged_stamp;
+    }
+
+    block_t *block_next = find_next(block);
+    write_header(block_next, asize, true);
+    set_prev_alloc(block_next, false);
+    set_prev_alloc(find_next(block_next), true);
+    mark_dirty(arena, block_next);
+
+    return block_next;
+}
+
+/*
+ * find_fit looks up a free block of at least asize bytes in the lists
+ * according to fit_policy, then in the tree of large blocks, which is always
+ * searched for the best fit. Returns NULL if there is none.
+ */
+static block_t *find_fit(arena_t *arena, size_t asize)
+{
+    block_t *block;
+
+    if (asize >= tree_min_size)
+    {
+        return tree_find(arena, asize);
+    }
+
+    switch (fit_policy)
+    {
+    case FIT_FIRST:
+        block = find_scan_fit(arena, asize, 1);
+        break;
+    case FIT_NEXT:
+        block = find_next_fit(arena, asize);
+        break;
+    case FIT_BEST:
+        block = find_scan_fit(arena, asize, UINT32_MAX);
+        break;
+    case FIT_NTH:
+        block = find_scan_fit(arena, asize, fit_nth);
+        break;
+    case FIT_INDEX:
+        block = find_index_fit(arena, asize);
+        break;
+    default:
+        block = find_good_fit(arena, asize);
+        break;
+    }
+
+    return (block != NULL) ? block : tree_find(arena, asize);
+}
+
+/*
+ * find_good_fit looks up a free block of at least asize bytes in constant time.
+ * The request is rounded up to the next size class so that every block in
+ * the first non-empty list at or above that class is guaranteed to fit
+ * (good fit). When nothing is found that way, the head of the request's own
+ * class is tried as well, since it may still be large enough.
+ */
+static block_t *find_good_fit(arena_t *arena, size_t asize)
+{
+    int fl, sl;
+    mapping_insert(mapping_round_up(asize), &fl, &sl);
+
+    // Non-empty lists in the same first-level class, at or above sl
+    uint32_t sl_map = arena->sl_bitmap[fl] & (~(uint32_t)0 << sl);
+
+    if (sl_map == 0) {
+        // Otherwise take the smallest non-empty first-level class above fl
+        word_t fl_map = arena->fl_bitmap & (~(word_t)0 << (fl + 1));
+
+        if (fl_map == 0) {
+            block_t *block;
+            mapping_insert(asize, &fl, &sl);
+            block = arena->free_lists[fl][sl];
+            stats_fit(block != NULL);
+            if (block != NULL && get_size(block) >= asize) {
+                return block;
+            }
+            return NULL;
+        }
+
+        fl = find_first_set(fl_map);
+        sl_map = arena->sl_bitmap[fl];
+    }
+
+    sl = find_first_set(sl_map);
+    stats_fit(1);
+    return arena->free_lists[fl][sl];
+}
+
+/*
+ * find_scan_fit walks the free lists from the class of asize upwards and
+ * returns the smallest of the first limit fitting blocks it meets. The walk
+ * ends with the first class that has a fitting block, or at an exact fit.
+ */
+static block_t *find_scan_fit(arena_t *arena, size_t asize, unsigned limit)
+{
+    int fl, sl;
+    mapping_insert(asize, &fl, &sl);
+
+    block_t *best = NULL;
+    unsigned candidates = 0;
+    unsigned fits = 0;
+    bool more = ((arena->sl_bitmap[fl] >> sl) & 1)
+                || next_class(arena, &fl, &sl);
+
+    while (more && best == NULL)
+    {
+        block_t *block;
+        for (block = arena->free_lists[fl][sl]; block != NULL;
+             block = get_next(arena, block))
+        {
+            size_t size = get_size(block);
+
+            candidates++;
+            if (size < asize)
+            {
+                continue;
+            }
+            if (best == NULL || size < get_size(best))
+            {
+                best = block;
+            }
+            if (++fits >= limit || size == asize)
+            {
+                break;
+            }
+        }
+        more = next_class(arena, &fl, &sl);
+    }
+
+    stats_fit(candidates);
+    return best;
+}
+
+/*
+ * find_next_fit is first fit that resumes the walk of a list after the block
+ * the last search returned, as long as that list's class is large enough.
+ * Otherwise it starts over from the class of asize.
+ */
+static block_t *find_next_fit(arena_t *arena, size_t asize)
+{
+    block_t *block = arena->rover;
+    unsigned candidates = 0;
+
+    if (block != NULL)
+    {
+        int fl, sl, rover_fl, rover_sl;
+        mapping_insert(asize, &fl, &sl);
+        mapping_insert(get_size(block), &rover_fl, &rover_sl);
+
+        if (rover_fl < fl || (rover_fl == fl && rover_sl < sl))
+        {
+            block = NULL;
+        }
+
+        for (; block != NULL; block = get_next(arena, block))
+        {
+            candidates++;
+            if (get_size(block) >= asize)
+            {
+                break;
+            }
+        }
+    }
+
+    if (block != NULL)
+    {
+        stats_fit(candidates);
+    }
+    else
+    {
+        block = find_scan_fit(arena, asize, 1);
+    }
+
+    arena->rover = (block != NULL) ? get_next(arena, block) : NULL;
+    return block;
+}
+
+/*
+ * find_index_fit is FIT_NTH over the size index: it returns the smallest of
+ * the first fit_nth fitting blocks in index order, stopping at an exact fit.
+ */
+static block_t *find_index_fit(arena_t *arena, size_t asize)
+{
+    if (arena->index_dropped)
+    {
+        return find_scan_fit(arena, asize, fit_nth);
+    }
+
+    // The only class of blocks left out of the index is exactly this size
+    if (asize == min_block_size)
+    {
+        int fl, sl;
+        mapping_insert(asize, &fl, &sl);
+        if (arena->free_lists[fl][sl] != NULL)
+        {
+            stats_fit(1);
+            return arena->free_lists[fl][sl];
+        }
+    }
+
+    uint32_t *sizes = arena->index_sizes;
+    uint32_t count = arena->index_count;
+    uint32_t end = (uint32_t)round_up(count, index_lanes);
+    uint32_t best = count;
+    unsigned fits = 0;
+    uint32_t pos = 0;
+
+    while ((pos = index_scan(sizes, pos, end, (uint32_t)asize)) < count)
+    {
+        if (best == count || sizes[pos] < sizes[best])
+        {
+            best = pos;
+        }
+        if (++fits >= fit_nth || sizes[pos] == asize)
+        {
+            break;
+        }
+        pos++;
+    }
+
+    stats_fit((pos < count) ? pos + 1 : count);
+    return (best < count) ? decode_link(arena, arena->index_links[best]) : NULL;
+}
+
+/*
+ * next_class moves fl and sl to the first non-empty class above them.
+ * Returns false if there is none.
+ */
+static bool next_class(arena_t *arena, int *fl, int *sl)
+{
+    uint32_t sl_map = arena->sl_bitmap[*fl] & (~(uint32_t)0 << (*sl + 1));
+
+    if (sl_map == 0)
+    {
+        word_t fl_map = arena->fl_bitmap & (~(word_t)0 << (*fl + 1));
+        if (fl_map == 0)
+        {
+            return false;
+        }
+
+        *fl = find_first_set(fl_map);
+        sl_map = arena->sl_bitmap[*fl];
+    }
+
+    *sl = find_first_set(sl_map);
+    return true;
+}
+
+/* 
+ * The heap checker verifies that certain heap invariants have not been violated
+ * in every arena that has a heap.
+ */
+bool mm_checkheap(int line)  
+{ 
+    for (unsigned i = 0; i < arena_count; i++) {
+        if (arenas[i].heap_start != NULL && !check_arena(&arenas[i], line)) {
+            printf("Line %d: Arena %u is inconsistent\n", line, i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * check_arena verifies the invariants of one arena's heap. It calls an
+ * assortment of helper function for modularity.
+ */
+static bool check_arena(arena_t *arena, int line)
+{
+    // Coalesce: Making sure there are no adjacent free blocks
+    if (!no_adjacent_free_blocks(arena)) {
+        printf("Line %d: Two adjacent free blocks!\n", line);
+        return false;
+    }
+
+    // Explicit List: Making sure there are no cycles in free doubly linked list
+    if (!no_free_list_cycles(arena)) {
+        printf("Line %d: Cycle in free list!\n", line);
+        return false;
+    }
+
+    // Segregated Index: Making sure bitmaps and size classes match the lists
+    if (!free_index_consistent(arena)) {
+        printf("Line %d: Free index mismatch!\n", line);
+        return false;
+    }
+
+    // Large Block Tree: Making sure the tree is ordered and balanced
+    if (!tree_consistent(arena)) {
+        printf("Line %d: Large block tree mismatch!\n", line);
+        return false;
+    }
+
+    // Size Index: Making sure the index matches the free blocks
+    if (!size_index_consistent(arena)) {
+        printf("Line %d: Size index mismatch!\n", line);
+        return false;
+    }
+
+    // Explicit List: Making sure explicit list matches implicit list
+    if (!correct_num_free_blocks(arena)) {
+        printf("Line %d: Explicit-Implicit Count Mismatch!\n", line);
+        return false;
+    }
+
+    // Quick Lists: Checking that deferred blocks are filed by their size
+    if (!quick_lists_consistent(arena)) {
+        printf("Line %d: Quick list mismatch!\n", line);
+        return false;
+    }
+
+    // Slabs: Checking that slab lists, counts and the slab map agree
+    if (!slabs_consistent(arena)) {
+        printf("Line %d: Slab mismatch!\n", line);
+        return false;
+    }
+
+    // Removing Footers: Checking that prev alloc bits are correct
+        if (!checkAllPrevAllocBits(arena)) {
+        printf("Line %d: Prev alloc bit mismatch!\n", line);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * max: returns x if x > y, and y otherwise.
+ */
+static size_t max(size_t x, size_t y)
+{
+    return (x > y) ? x : y;
+}
+
+/*
+ * min: returns x if x < y, and y otherwise.
+ */
+static size_t min(size_t x, size_t y)
+{
+    return (x < y) ? x : y;
+}
+
+/*
+ * round_up: Rounds size up to next multiple of n
+ */
+static size_t round_up(size_t size, size_t n)
+{
+    return (n * ((size + (n-1)) / n));
+}
+
+/*
+ * pack: returns a header reflecting a specified size and its alloc status.
+ *       If the block is allocated, the lowest bit is set to 1, and 0 otherwise.
+ */
+static word_t pack(size_t size, bool alloc)
+{
+    return alloc ? (size | alloc_mask) : size;
+}
+
+
+/*
+ * extract_size: returns the size of a given header value based on the header
+ *               specification above.
+ */
+static size_t extract_size(word_t word)
+{
+    return (word & size_mask);
+}
+
+/*
+ * get_size: returns the size of a given block by clearing the lowest 4 bits
+ *           (as the heap is 16-byte aligned).
+ */
+static size_t get_size(block_t *block)
+{
+    return extract_size(block->header);
+}
+
+/*
+ * get_payload_size: returns the payload size of a given block, equal to
+ *                   the entire block size minus the header and footer sizes.
+ */
+static word_t get_payload_size(block_t *block)
+{
+    size_t asize = get_size(block);
+    return asize - wsize;
+}
+
+/*
+ * extract_alloc: returns the allocation status of a given header value based
+ *                on the header specification above.
+ */
+static bool extract_alloc(word_t word)
+{
+    return (bool)(word & alloc_mask);
+}
+
+static size_t extract_prev_alloc(word_t word)
+{
+    size_t alloc_bit = (word & prev_alloc_mask);
+    return alloc_bit;
+}
+
+static void set_prev_alloc(block_t * block, bool state) {
+
+    if (block != NULL) {
+        if (state==true) {
+            block->header = (block->header | prev_alloc_mask) & ~prev_min_mask;
+
+        } else {
+            block->header = (block->header & ~(prev_alloc_mask));
+        }
+    }
+
+}
+
+/*
+ * get_alloc: returns true when the block is allocated based on the
+ *            block header's lowest bit, and false otherwise.
+ */
+static bool get_alloc(block_t *block)
+{
+    return extract_alloc(block->header);
+}
+
+/*
+ * write_header: given a block and its size and allocation status,
+ *               writes an appropriate value to the block header. In the
+ *               compact layout it keeps prev_min_mask, which belongs to the
+ *               block before.
+ */
+static void write_header(block_t *block, size_t size, bool alloc)
+{
+    word_t prev_min = 0;
+    if (layout == LAYOUT_COMPACT)
+    {
+        prev_min = block->header & prev_min_mask;
+    }
+    block->header = pack(size, alloc) | prev_min;
+}
+
+
+/*
+ * write_footer: given a block and its size and allocation status,
+ *               writes an appropriate value to the block footer by first
+ *               computing the position of the footer. In the compact layout
+ *               a free block of min_block_size bytes has no room for one, so
+ *               the next block's prev_min_mask is set instead; the next
+ *               block's header must already be in place.
+ */
+static void write_footer(block_t *block, size_t size, bool alloc)
+{
+    if (layout == LAYOUT_COMPACT)
+    {
+        block_t *block_next = find_next(block);
+        if (size == min_block_size)
+        {
+            block_next->header |= prev_min_mask;
+            return;
+        }
+        block_next->header &= ~prev_min_mask;
+    }
+
+    word_t *footerp = (word_t *)((block->payload) + get_size(block) - dsize);
+    *footerp = pack(size, alloc);
+}
+
+
+/*
+ * find_next: returns the next consecutive block on the heap by adding the
+ *            size of the block.
+ */
+static block_t *find_next(block_t *block)
+{
+    dbg_requires(block != NULL);
+    block_t *block_next = (block_t *)(((char *)block) + get_size(block));
+
+    dbg_ensures(block_next != NULL);
+    return block_next;
+}
+
+/*
+ * find_prev_footer: returns the footer of the previous block.
+ */
+static word_t *find_prev_footer(block_t *block)
+{
+    // Compute previous footer position as one word before the header
+    return (&(block->header)) - 1;
+}
+
+/*
+ * find_prev: returns the previous block position by checking the previous
+ *            block's footer and calculating the start of the previous block
+ *            based on its size. Only valid when the previous block is free.
+ */
+static block_t *find_prev(block_t *block)
+{
+    if (layout == LAYOUT_COMPACT && (block->header & prev_min_mask))
+    {
+        return (block_t *)((char *)block - min_block_size);
+    }
+
+    word_t *footerp = find_prev_footer(block);
+    size_t size = extract_size(*footerp);
+    return (block_t *)((char *)block - size);
+}
+
+/*
+ * get_next: returns the block after a free block in its list, or NULL. The
+ *           compact layout keeps the links as offsets from heap_start in
+ *           dsize units, plus one so that zero stands for NULL.
+ */
+static block_t *get_next(arena_t *arena, block_t *block)
+{
+    if (layout == LAYOUT_COMPACT)
+    {
+        return decode_link(arena, block->next_link);
+    }
+    return block->next;
+}
+
+/*
+ * get_prev: returns the block before a free block in its list, or NULL.
+ */
+static block_t *get_prev(arena_t *arena, block_t *block)
+{
+    if (layout == LAYOUT_COMPACT)
+    {
+        return decode_link(arena, block->prev_link);
+    }
+    return block->prev;
+}
+
+/*
+ * encode_link: returns the compact link to a block, or 0 for NULL
+ */
+static uint32_t encode_link(arena_t *arena, block_t *block)
+{
+    if (block == NULL)
+    {
+        return 0;
+    }
+    size_t offset = (size_t)((char *)block - (char *)arena->heap_start);
+    dbg_assert(offset / dsize < UINT32_MAX);
+    return (uint32_t)(offset / dsize) + 1;
+}
+
+/*
+ * decode_link: returns the block a compact link leads to, or NULL for 0
+ */
+static block_t *decode_link(arena_t *arena, uint32_t link)
+{
+    if (link == 0)
+    {
+        return NULL;
+    }
+    return (block_t *)((char *)arena->heap_start + (size_t)(link - 1) * dsize);
+}
+
+/*
+ * set_next: makes next follow a free block in its list.
+ */
+static void set_next(arena_t *arena, block_t *block, block_t *next)
+{
+    if (layout == LAYOUT_COMPACT)
+    {
+        block->next_link = encode_link(arena, next);
+        return;
+    }
+    block->next = next;
+}
+
+/*
+ * set_prev: makes prev precede a free block in its list.
+ */
+static void set_prev(arena_t *arena, block_t *block, block_t *prev)
+{
+    if (layout == LAYOUT_COMPACT)
+    {
+        block->prev_link = encode_link(arena, prev);
+        return;
+    }
+    block->prev = prev;
+}
+
+/*
+ * payload_to_header: given a payload pointer, returns a pointer to the
+ *                    corresponding block.
+ */
+static block_t *payload_to_header(void *bp)
+{
+    return (block_t *)(((char *)bp) - offsetof(block_t, payload));
+}
+
+/*
+ * header_to_payload: given a block pointer, returns a pointer to the
+ *                    corresponding payload.
+ */
+static void *header_to_payload(block_t *block)
+{
+    return (void *)(block->payload);
+}
+
+/*
+* Helper function that prints all the blocks in the implicit list along with 
+* their size, allocation and potentially their prev and next pointers if they
+* are free
+*/
+static void print_blocks(arena_t *arena) {
+
+    block_t * current = arena->heap_start;
+
+    word_t * prologueFooter = find_prev_footer(current);
+    size_t PF_size = extract_size(*prologueFooter);
+    bool PF_alloc = extract_alloc(*prologueFooter);
+
+    printf("%s %s %zu %s %d\n", 
+            "prologue footer","size:", PF_size, "alloc:", PF_alloc);
+
+    size_t size = extract_size((current)->header);
+    bool alloc = extract_alloc((current)->header);
+
+    int count = 0;
+
+    // while we haven't reached the epilogue header block
+    while(!(size==0 && alloc==1)) {
+        
+        printf("%s %p ", "Block", current);
+        printf("%s: %zu ","Size",size);
+        printf("%s: %d ","Alloc",alloc);
+
+        if (alloc == 0) {
+            if (get_prev(arena, current) == NULL) {
+                printf("%s: %s ","Prev", "null");
+            } else {
+                printf("%s: %p ","Prev", get_prev(arena, current));
+            }
+
+            if (get_next(arena, current) == NULL) {
+                printf("%s: %s ","Next", "null");
+            } else {
+                printf("%s: %p ","Next", get_next(arena, current));
+            }
+
+        } else {
+            printf("%s: %s ","Prev", "PAYLOAD");
+            printf("%s: %s ","Next", "PAYLOAD");
+
+        }
+
+        size_t alloc_bit = extract_prev_alloc(current->header);
+        printf("%s %zu", "Prev Alloc:", alloc_bit);
+
+        printf("\n");
+
+        count++;
+        current = find_next(current);
+        size = extract_size((current)->header);
+        alloc = extract_alloc((current)->header);
+    }
+
+    block_t * epilogueHeader = current;
+    size_t EH_size = extract_size((epilogueHeader)->header);
+    bool EH_alloc = extract_alloc((epilogueHeader)->header);
+
+    printf("%s %s %zu %s %d\n", 
+            "epilogue header","size:", EH_size, "alloc:", EH_alloc);
+    printf("\n");
+
+}
+
+/*
+* Helper function that strictly prints all free blocks along with their prev
+* and next pointers, one line per non-empty size class
+*/
+static void print_free_list(arena_t *arena) {
+    printf("free list:\n");
+
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++) {
+        for (int sl = 0; sl < SL_INDEX_COUNT; sl++) {
+
+            block_t * current = arena->free_lists[fl][sl];
+            if (current == NULL) {
+                continue;
+            }
+
+            int count = 0;
+            printf("[%d][%d]: %p -> ", fl, sl, current);
+
+            while (current != NULL) {
+                if (count > 10) {
+                    break;
+                }
+                printf("%p ->", get_next(arena, current));
+                count++;
+
+                current = get_next(arena, current);
+            }
+            printf("\n");
+        }
+    }
+
+}
+
+/*
+* find_last_set returns the index of the most significant set bit of a
+* non-zero word
+*/
+static int find_last_set(word_t word) {
+    dbg_requires(word != 0);
+    return 63 - __builtin_clzll(word);
+}
+
+/*
+* find_first_set returns the index of the least significant set bit of a
+* non-zero word
+*/
+static int find_first_set(word_t word) {
+    dbg_requires(word != 0);
+    return __builtin_ctzll(word);
+}
+
+/*
+* mapping_insert computes the first- and second-level index of the class that
+* holds free blocks of the given size
+*/
+static void mapping_insert(size_t size, int *fl, int *sl) {
+
+    if (size < small_block_size) {
+        // Small sizes are classed linearly in dsize steps
+        *fl = 0;
+        *sl = (int)(size / dsize);
+        return;
+    }
+
+    int msb = find_last_set(size);
+
+    if (msb > FL_INDEX_MAX) {
+        *fl = FL_INDEX_COUNT - 1;
+        *sl = SL_INDEX_COUNT - 1;
+        return;
+    }
+
+    // The SL_INDEX_COUNT_LOG2 bits below the leading one pick the class
+    *sl = (int)(size >> (msb - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+    *fl = msb - (FL_INDEX_SHIFT - 1);
+}
+
+/*
+* mapping_round_up rounds a request up to the smallest size of the next class,
+* so that every block found in that class or above is large enough
+*/
+static size_t mapping_round_up(size_t size) {
+
+    if (size >= small_block_size) {
+        size_t class_size = (size_t)1 <<
+                            (find_last_set(size) - SL_INDEX_COUNT_LOG2);
+        size += class_size - 1;
+    }
+    return size;
+}
+
+/*
+* prepend_to_free_list takes a pointer to a block that it proceeds to insert 
+* at the head of the list of its size class, or at its place by address under
+* INSERT_ADDRESS, marking that list as non-empty. Large blocks are inserted
+* in the tree instead.
+*/
+static void prepend_to_free_list(arena_t *arena, block_t * block) {
+
+    if (get_size(block) >= purge_min_size) {
+        *get_stamp(block) = now_ms();
+    }
+
+    // Large blocks go to the tree instead
+    if (get_size(block) >= tree_min_size) {
+        tree_insert(arena, block);
+        return;
+    }
+
+    int fl, sl;
+    mapping_insert(get_size(block), &fl, &sl);
+
+    block_t * prev = NULL;
+    block_t * head = arena->free_lists[fl][sl];
+
+    if (insert_policy == INSERT_ADDRESS) {
+        while (head != NULL && head < block) {
+            prev = head;
+            head = get_next(arena, head);
+        }
+    }
+
+    set_prev(arena, block, prev);
+    set_next(arena, block, head);
+    if (head != NULL) {
+        set_prev(arena, head, block);
+    }
+    if (prev != NULL) {
+        set_next(arena, prev, block);
+    } else {
+        arena->free_lists[fl][sl] = block;
+    }
+
+    arena->fl_bitmap |= (word_t)1 << fl;
+    arena->sl_bitmap[fl] |= (uint32_t)1 << sl;
+
+    if (fit_policy == FIT_INDEX && get_size(block) > min_block_size) {
+        index_insert(arena, block);
+    }
+}
+
+/*
+* remove_from_free_list takes a pointer to a block that it proceeds to remove 
+* from the list of its size class by redirecting the prev and next pointers of
+* the blocks to its left and right. The bitmaps are cleared once the list
+* becomes empty. Large blocks are removed from the tree instead. The block
+* header must still hold the size it was indexed by.
+*/
+static void remove_from_free_list(arena_t *arena, block_t * block) {
+
+    if (get_size(block) >= tree_min_size) {
+        tree_remove(arena, block);
+        return;
+    }
+
+    if (fit_policy == FIT_INDEX && get_size(block) > min_block_size) {
+        index_remove(arena, block);
+    }
+
+    int fl, sl;
+    mapping_insert(get_size(block), &fl, &sl);
+
+    block_t * prev = get_prev(arena, block);
+    block_t * next = get_next(arena, block);
+
+    // Under FIT_NEXT, the next search resumes where this block stood
+    if (fit_policy == FIT_NEXT && arena->rover == block) {
+        arena->rover = next;
+    }
+
+    if (next != NULL) {
+        set_prev(arena, next, prev);
+    }
+
+    if (prev != NULL) {
+        set_next(arena, prev, next);
+    } else {
+        arena->free_lists[fl][sl] = next;
+
+        if (next == NULL) {
+            arena->sl_bitmap[fl] &= ~((uint32_t)1 << sl);
+            if (arena->sl_bitmap[fl] == 0) {
+                arena->fl_bitmap &= ~((word_t)1 << fl);
+            }
+        }
+    }
+}
+
+// Large Block Tree
+
+/*
+* get_tree returns where a large free block keeps its tree links, right after
+* its stamp
+*/
+static tree_links_t *get_tree(block_t *block) {
+    return (tree_links_t *)(get_stamp(block) + 1);
+}
+
+/*
+* tree_red returns true when a node is red; missing leaves are black
+*/
+static bool tree_red(block_t *block) {
+    return block != NULL && get_tree(block)->color == TREE_RED;
+}
+
+/*
+* tree_replace_child puts new where old hangs off parent, or at the root when
+* parent is NULL
+*/
+static void tree_replace_child(arena_t *arena, block_t *parent,
+                               block_t *old, block_t *new) {
+
+    if (parent == NULL) {
+        arena->tree_root = new;
+    } else if (get_tree(parent)->left == old) {
+        get_tree(parent)->left = new;
+    } else {
+        get_tree(parent)->right = new;
+    }
+}
+
+/*
+* tree_rotate_left lifts the right child of x into its place
+*/
+static void tree_rotate_left(arena_t *arena, block_t *x) {
+
+    tree_links_t *xt = get_tree(x);
+    block_t *y = xt->right;
+    tree_links_t *yt = get_tree(y);
+
+    xt->right = yt->left;
+    if (yt->left != NULL) {
+        get_tree(yt->left)->parent = x;
+    }
+
+    yt->parent = xt->parent;
+    tree_replace_child(arena, xt->parent, x, y);
+
+    yt->left = x;
+    xt->parent = y;
+}
+
+/*
+* tree_rotate_right lifts the left child of x into its place
+*/
+static void tree_rotate_right(arena_t *arena, block_t *x) {
+
+    tree_links_t *xt = get_tree(x);
+    block_t *y = xt->left;
+    tree_links_t *yt = get_tree(y);
+
+    xt->left = yt->right;
+    if (yt->right != NULL) {
+        get_tree(yt->right)->parent = x;
+    }
+
+    yt->parent = xt->parent;
+    tree_replace_child(arena, xt->parent, x, y);
+
+    yt->right = x;
+    xt->parent = y;
+}
+
+/*
+* tree_insert adds a large free block to the tree, or to the chain of the
+* node of its size if there is one. Requires arena->lock.
+*/
+static void tree_insert(arena_t *arena, block_t *block) {
+
+    size_t size = get_size(block);
+    tree_links_t *bt = get_tree(block);
+    block_t *parent = NULL;
+    block_t *node = arena->tree_root;
+
+    while (node != NULL) {
+        size_t node_size = get_size(node);
+
+        if (size == node_size) {
+            set_prev(arena, block, node);
+            set_next(arena, block, get_next(arena, node));
+            if (get_next(arena, node) != NULL) {
+                set_prev(arena, get_next(arena, node), block);
+            }
+            set_next(arena, node, block);
+            bt->color = TREE_CHAINED;
+            return;
+        }
+
+        parent = node;
+        node = (size < node_size) ? get_tree(node)->left
+                                  : get_tree(node)->right;
+    }
+
+    set_prev(arena, block, NULL);
+    set_next(arena, block, NULL);
+    bt->left = NULL;
+    bt->right = NULL;
+    bt->parent = parent;
+    bt->color = TREE_RED;
+
+    if (parent == NULL) {
+        arena->tree_root = block;
+    } else if (size < get_size(parent)) {
+        get_tree(parent)->left = block;
+    } else {
+        get_tree(parent)->right = block;
+    }
+
+    // Restore the red-black properties on the way up
+    block_t *x = block;
+    while (tree_red(get_tree(x)->parent)) {
+        block_t *p = get_tree(x)->parent;
+        block_t *g = get_tree(p)->parent;
+
+        if (p == get_tree(g)->left) {
+            block_t *uncle = get_tree(g)->right;
+
+            if (tree_red(uncle)) {
+                get_tree(p)->color = TREE_BLACK;
+                get_tree(uncle)->color = TREE_BLACK;
+                get_tree(g)->color = TREE_RED;
+                x = g;
+                continue;
+            }
+            if (x == get_tree(p)->right) {
+                x = p;
+                tree_rotate_left(arena, x);
+                p = get_tree(x)->parent;
+            }
+            get_tree(p)->color = TREE_BLACK;
+            get_tree(g)->color = TREE_RED;
+            tree_rotate_right(arena, g);
+        } else {
+            block_t *uncle = get_tree(g)->left;
+
+            if (tree_red(uncle)) {
+                get_tree(p)->color = TREE_BLACK;
+                get_tree(uncle)->color = TREE_BLACK;
+                get_tree(g)->color = TREE_RED;
+                x = g;
+                continue;
+            }
+            if (x == get_tree(p)->left) {
+                x = p;
+                tree_rotate_right(arena, x);
+                p = get_tree(x)->parent;
+            }
+            get_tree(p)->color = TREE_BLACK;
+            get_tree(g)->color = TREE_RED;
+            tree_rotate_left(arena, g);
+        }
+    }
+
+    get_tree(arena->tree_root)->color = TREE_BLACK;
+}
+
+/*
+* tree_remove takes a large free block out of the tree. A chained block is
+* simply unlinked, and a node with a chain hands its place to the next block
+* of its size, so only the last block of a size changes the tree's shape.
+* Requires arena->lock.
+*/
+static void tree_remove(arena_t *arena, block_t *block) {
+
+    tree_links_t *bt = get_tree(block);
+
+    if (bt->color == TREE_CHAINED) {
+        set_next(arena, get_prev(arena, block), get_next(arena, block));
+        if (get_next(arena, block) != NULL) {
+            set_prev(arena, get_next(arena, block), get_prev(arena, block));
+        }
+        return;
+    }
+
+    if (get_next(arena, block) != NULL) {
+        block_t *heir = get_next(arena, block);
+
+        *get_tree(heir) = *bt;
+        set_prev(arena, heir, NULL);
+        tree_replace_child(arena, bt->parent, block, heir);
+        if (bt->left != NULL) {
+            get_tree(bt->left)->parent = heir;
+        }
+        if (bt->right != NULL) {
+            get_tree(bt->right)->parent = heir;
+        }
+        return;
+    }
+
+    // Otherwise unlink the node, replacing it by its successor if it has
+    // two children
+    block_t *x;
+    block_t *x_parent;
+    word_t removed_color = bt->color;
+
+    if (bt->left == NULL || bt->right == NULL) {
+        x = (bt->left != NULL) ? bt->left : bt->right;
+        x_parent = bt->parent;
+        tree_replace_child(arena, bt->parent, block, x);
+        if (x != NULL) {
+            get_tree(x)->parent = x_parent;
+        }
+    } else {
+        block_t *y = bt->right;
+        while (get_tree(y)->left != NULL) {
+            y = get_tree(y)->left;
+        }
+
+        tree_links_t *yt = get_tree(y);
+        removed_color = yt->color;
+        x = yt->right;
+
+        if (yt->parent == block) {
+            x_parent = y;
+        } else {
+            x_parent = yt->parent;
+            tree_replace_child(arena, yt->parent, y, x);
+            if (x != NULL) {
+                get_tree(x)->parent = x_parent;
+            }
+            yt->right = bt->right;
+            get_tree(yt->right)->parent = y;
+        }
+
+        tree_replace_child(arena, bt->parent, block, y);
+        yt->parent = bt->parent;
+        yt->left = bt->left;
+        get_tree(yt->left)->parent = y;
+        yt->color = bt->color;
+    }
+
+    if (removed_color == TREE_BLACK) {
+        tree_remove_fixup(arena, x, x_parent);
+    }
+}
+
+/*
+* tree_remove_fixup restores the red-black properties after a black node was
+* unlinked from above x, whose parent is given since x may be a leaf
+*/
+static void tree_remove_fixup(arena_t *arena, block_t *x, block_t *parent) {
+
+    while (x != arena->tree_root && !tree_red(x)) {
+        tree_links_t *pt = get_tree(parent);
+
+        if (x == pt->left) {
+            block_t *w = pt->right;
+
+            if (tree_red(w)) {
+                get_tree(w)->color = TREE_BLACK;
+                pt->color = TREE_RED;
+                tree_rotate_left(arena, parent);
+                w = pt->right;
+            }
+            if (!tree_red(get_tree(w)->left) && !tree_red(get_tree(w)->right)) {
+                get_tree(w)->color = TREE_RED;
+                x = parent;
+                parent = pt->parent;
+                continue;
+            }
+            if (!tree_red(get_tree(w)->right)) {
+                get_tree(get_tree(w)->left)->color = TREE_BLACK;
+                get_tree(w)->color = TREE_RED;
+                tree_rotate_right(arena, w);
+                w = pt->right;
+            }
+            get_tree(w)->color = pt->color;
+            pt->color = TREE_BLACK;
+            get_tree(get_tree(w)->right)->color = TREE_BLACK;
+            tree_rotate_left(arena, parent);
+        } else {
+            block_t *w = pt->left;
+
+            if (tree_red(w)) {
+                get_tree(w)->color = TREE_BLACK;
+                pt->color = TREE_RED;
+                tree_rotate_right(arena, parent);
+                w = pt->left;
+            }
+            if (!tree_red(get_tree(w)->left) && !tree_red(get_tree(w)->right)) {
+                get_tree(w)->color = TREE_RED;
+                x = parent;
+                parent = pt->parent;
+                continue;
+            }
+            if (!tree_red(get_tree(w)->left)) {
+                get_tree(get_tree(w)->right)->color = TREE_BLACK;
+                get_tree(w)->color = TREE_RED;
+                tree_rotate_left(arena, w);
+                w = pt->left;
+            }
+            get_tree(w)->color = pt->color;
+            pt->color = TREE_BLACK;
+            get_tree(get_tree(w)->left)->color = TREE_BLACK;
+            tree_rotate_right(arena, parent);
+        }
+
+        x = arena->tree_root;
+    }
+
+    if (x != NULL) {
+        get_tree(x)->color = TREE_BLACK;
+    }
+}
+
+/*
+* tree_find returns a free block of the smallest size of at least asize
+* bytes in the tree, or NULL. A chained block is preferred to the node, as
+* it leaves the tree as it is. Requires arena->lock.
+*/
+static block_t *tree_find(arena_t *arena, size_t asize) {
+
+    block_t *best = NULL;
+    unsigned candidates = 0;
+
+    for (block_t *node = arena->tree_root; node != NULL; candidates++) {
+        size_t size = get_size(node);
+
+        if (size == asize) {
+            best = node;
+            break;
+        }
+        if (size > asize) {
+            best = node;
+            node = get_tree(node)->left;
+        } else {
+            node = get_tree(node)->right;
+        }
+    }
+
+    stats_fit(candidates);
+    if (best != NULL && get_next(arena, best) != NULL) {
+        return get_next(arena, best);
+    }
+    return best;
+}
+
+/*
+* tree_lower_bound returns the node of the smallest size of at least size
+* bytes, or NULL. Requires arena->lock.
+*/
+static block_t *tree_lower_bound(arena_t *arena, size_t size) {
+
+    block_t *best = NULL;
+    block_t *node = arena->tree_root;
+
+    while (node != NULL) {
+        if (get_size(node) >= size) {
+            best = node;
+            node = get_tree(node)->left;
+        } else {
+            node = get_tree(node)->right;
+        }
+    }
+    return best;
+}
+
+/*
+* tree_successor returns the node of the next larger size, or NULL
+*/
+static block_t *tree_successor(block_t *node) {
+
+    tree_links_t *nt = get_tree(node);
+
+    if (nt->right != NULL) {
+        node = nt->right;
+        while (get_tree(node)->left != NULL) {
+            node = get_tree(node)->left;
+        }
+        return node;
+    }
+
+    block_t *parent = nt->parent;
+    while (parent != NULL && node == get_tree(parent)->right) {
+        node = parent;
+        parent = get_tree(parent)->parent;
+    }
+    return parent;
+}
+
+// Size Index
+
+/*
+* get_index_slot returns where an indexed block keeps its position in the
+* index, right after its links
+*/
+static uint32_t *get_index_slot(block_t *block) {
+    size_t links = (layout == LAYOUT_COMPACT) ? wsize : dsize;
+    return (uint32_t *)(block->payload + links);
+}
+
+/*
+* index_grow doubles the capacity of the size index, moving it to a new
+* mapping. Returns false if there is no memory for one.
+*/
+static bool index_grow(arena_t *arena) {
+
+    uint32_t capacity = arena->index_capacity * 2;
+    if (capacity < index_initial) {
+        capacity = index_initial;
+    }
+
+    // Fresh pages read as zero, as every size past the last entry must
+    uint32_t *sizes = mmap(NULL, 2 * (size_t)capacity * sizeof(uint32_t),
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sizes == MAP_FAILED) {
+        return false;
+    }
+
+    uint32_t *links = sizes + capacity;
+    uint32_t count = arena->index_count;
+
+    if (arena->index_sizes != NULL) {
+        memcpy(sizes, arena->index_sizes, count * sizeof(uint32_t));
+        memcpy(links, arena->index_links, count * sizeof(uint32_t));
+        munmap(arena->index_sizes,
+               2 * (size_t)arena->index_capacity * sizeof(uint32_t));
+    }
+
+    arena->index_sizes = sizes;
+    arena->index_links = links;
+    arena->index_capacity = capacity;
+    return true;
+}
+
+/*
+* index_drop empties the size index and unmaps it. Until index_dropped is
+* cleared again, no block is indexed.
+*/
+static void index_drop(arena_t *arena) {
+
+    if (arena->index_sizes != NULL) {
+        munmap(arena->index_sizes,
+               2 * (size_t)arena->index_capacity * sizeof(uint32_t));
+    }
+
+    arena->index_sizes = NULL;
+    arena->index_links = NULL;
+    arena->index_count = 0;
+    arena->index_capacity = 0;
+    arena->index_dropped = true;
+}
+
+/*
+* index_insert appends a free block to the size index, dropping the index
+* if it cannot grow. Requires arena->lock.
+*/
+static void index_insert(arena_t *arena, block_t *block) {
+
+    if (arena->index_dropped) {
+        return;
+    }
+
+    if (arena->index_count == arena->index_capacity && !index_grow(arena)) {
+        index_drop(arena);
+        return;
+    }
+
+    uint32_t pos = arena->index_count++;
+    arena->index_sizes[pos] = (uint32_t)get_size(block);
+    arena->index_links[pos] = encode_link(arena, block);
+    *get_index_slot(block) = pos;
+}
+
+/*
+* index_remove takes a free block out of the size index, moving the last
+* entry into its place. Requires arena->lock.
+*/
+static void index_remove(arena_t *arena, block_t *block) {
+
+    if (arena->index_dropped) {
+        return;
+    }
+
+    uint32_t pos = *get_index_slot(block);
+    uint32_t last = --arena->index_count;
+    dbg_assert(decode_link(arena, arena->index_links[pos]) == block);
+
+    if (pos != last) {
+        arena->index_sizes[pos] = arena->index_sizes[last];
+        arena->index_links[pos] = arena->index_links[last];
+        *get_index_slot(decode_link(arena, arena->index_links[pos])) = pos;
+    }
+    arena->index_sizes[last] = 0;
+}
+
+/*
+* index_scan returns the first position from from on whose size is at least
+* asize, or end if there is none. end is a multiple of index_lanes.
+*/
+static uint32_t index_scan(const uint32_t *sizes, uint32_t from, uint32_t end,
+                           uint32_t asize) {
+#if defined(__x86_64__)
+    if (index_avx2) {
+        return index_scan_avx2(sizes, from, end, asize);
+    }
+    return index_scan_sse2(sizes, from, end, asize);
+#else
+    return index_scan_scalar(sizes, from, end, asize);
+#endif
+}
+
+/*
+* index_scan_scalar is index_scan one size at a time
+*/
+static uint32_t index_scan_scalar(const uint32_t *sizes, uint32_t from,
+                                  uint32_t end, uint32_t asize) {
+
+    for (uint32_t pos = from; pos < end; pos++) {
+        if (sizes[pos] >= asize) {
+            return pos;
+        }
+    }
+    return end;
+}
+
+#if defined(__x86_64__)
+/*
+* index_scan_sse2 is index_scan four sizes at a time. Sizes stay far below
+* 2^31, so the signed compare is safe.
+*/
+static uint32_t index_scan_sse2(const uint32_t *sizes, uint32_t from,
+                                uint32_t end, uint32_t asize) {
+
+    __m128i below = _mm_set1_epi32((int)(asize - 1));
+    uint32_t pos = from & ~(uint32_t)3;
+    unsigned skip = ~0u << (from & 3);
+
+    for (; pos < end; pos += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(sizes + pos));
+        unsigned mask = (unsigned)_mm_movemask_ps(
+            _mm_castsi128_ps(_mm_cmpgt_epi32(v, below))) & skip;
+        if (mask != 0) {
+            return pos + (uint32_t)__builtin_ctz(mask);
+        }
+        skip = ~0u;
+    }
+    return end;
+}
+
+/*
+* index_scan_avx2 is index_scan eight sizes at a time
+*/
+static uint32_t index_scan_avx2(const uint32_t *sizes, uint32_t from,
+                                uint32_t end, uint32_t asize) {
+
+    __m256i below = _mm256_set1_epi32((int)(asize - 1));
+    uint32_t pos = from & ~(uint32_t)7;
+    unsigned skip = ~0u << (from & 7);
+
+    for (; pos < end; pos += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(sizes + pos));
+        unsigned mask = (unsigned)_mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpgt_epi32(v, below))) & skip;
+        if (mask != 0) {
+            return pos + (uint32_t)__builtin_ctz(mask);
+        }
+        skip = ~0u;
+    }
+    return end;
+}
+#endif
+
+// Mapped Blocks
+
+/*
+* page_size returns the system page size
+*/
+static size_t page_size(void) {
+
+    static size_t size = 0;
+
+    if (size == 0) {
+        size = (size_t)sysconf(_SC_PAGESIZE);
+    }
+    return size;
+}
+
+/*
+* get_mmapped: returns true when an allocated block has its own mapping
+*/
+static bool get_mmapped(block_t *block) {
+    return (block->header & mmap_mask) != 0;
+}
+
+/*
+* mmap_malloc maps a block of at least asize bytes and returns its payload.
+* The mapping is the block plus a leading word that keeps the payload
+* 16-byte aligned, rounded to whole pages.
+*/
+static void *mmap_malloc(size_t asize) {
+    return mmap_malloc_aligned(asize, dsize);
+}
+
+/*
+* mmap_malloc_aligned is mmap_malloc for a payload aligned to align, a power
+* of two. The mapping is made align bytes longer and the pages wholly before
+* the aligned block or after it are unmapped again. The leading word holds
+* the lead, the bytes left between the start of the mapping and that word.
+*/
+static void *mmap_malloc_aligned(size_t asize, size_t align) {
+
+    size_t page = page_size();
+    size_t slack = (align > dsize) ? align : 0;
+    size_t length = round_up(asize + dsize + slack, page);
+
+    char *start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+        return NULL;
+    }
+
+    char *payload = (char *)round_up((size_t)start + dsize, align);
+    char *first = (char *)((size_t)(payload - dsize) & ~(page - 1));
+    char *last = (char *)round_up((size_t)payload + asize, page);
+
+    if (first > start) {
+        munmap(start, (size_t)(first - start));
+    }
+    if (last < start + length) {
+        munmap(last, (size_t)(start + length - last));
+    }
+
+    block_t *block = payload_to_header(payload);
+    *((word_t *)block - 1) = (word_t)(payload - dsize - first);
+    block->header = pack((size_t)(last - payload), true) | mmap_mask;
+    heap_grow((size_t)(last - first));
+
+    return payload;
+}
+
+/*
+* mmap_lead returns the bytes a mapped block's mapping starts before its
+* leading word
+*/
+static size_t mmap_lead(block_t *block) {
+    return *((word_t *)block - 1);
+}
+
+/*
+* mmap_free unmaps a block that has its own mapping
+*/
+static void mmap_free(block_t *block) {
+
+    size_t lead = mmap_lead(block);
+    size_t length = lead + get_size(block) + dsize;
+
+    munmap((char *)block - wsize - lead, length);
+    heap_shrink(length);
+}
+
+/*
+* mmap_realloc resizes the mapping of a block to fit asize bytes, letting the
+* kernel move its pages instead of copying them. Returns the new payload, or
+* NULL with the block untouched if the mapping cannot be resized.
+*/
+static void *mmap_realloc(block_t *block, size_t asize) {
+
+    size_t lead = mmap_lead(block);
+    size_t old_length = lead + get_size(block) + dsize;
+    size_t length = round_up(lead + asize + dsize, page_size());
+
+    if (length == old_length) {
+        return header_to_payload(block);
+    }
+
+    // The pages move as a whole, so the lead stays where it was
+    char *start = mremap((char *)block - wsize - lead, old_length, length,
+                         MREMAP_MAYMOVE);
+    if (start == MAP_FAILED) {
+        return NULL;
+    }
+
+    block = (block_t *)(start + lead + wsize);
+    block->header = pack(length - dsize - lead, true) | mmap_mask;
+
+    if (length > old_length) {
+        heap_grow(length - old_length);
+    } else {
+        heap_shrink(old_length - length);
+    }
+
+    return header_to_payload(block);
+}
+
+// Purging
+
+/*
+* now_ms returns a coarse monotonic time in milliseconds
+*/
+static word_t now_ms(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (word_t)ts.tv_sec * 1000 + (word_t)ts.tv_nsec / 1000000;
+}
+
+/*
+* get_stamp returns where a free block keeps its stamp, right after its links
+*/
+static word_t *get_stamp(block_t *block) {
+    return (word_t *)(block->payload + dsize);
+}
+
+/*
+* get_purged: returns true when a free block's inner pages have been purged
+*/
+static bool get_purged(block_t *block) {
+    return get_size(block) >= purge_min_size
+           && *get_stamp(block) == purged_stamp;
+}
+
+/*
+* purge_granule returns the unit memory is given back in: a huge page under
+* MM_HUGE_PAGES, a page otherwise
+*/
+static size_t purge_granule(void) {
+    return huge_pages ? huge_page_size : page_size();
+}
+
+/*
+* purge_range finds the whole purge granules of a free block that lie between
+* its tree links and its footer. Returns false if there are none.
+*/
+static bool purge_range(block_t *block, char **start, char **end) {
+
+    size_t page = purge_granule();
+
+    *start = (char *)round_up((size_t)block + free_meta_size, page);
+    *end = (char *)(((size_t)block + get_size(block) - wsize) & ~(page - 1));
+    return *start < *end;
+}
+
+/*
+* purge_block gives the inner pages of a free block back to the OS and marks
+* the block purged
+*/
+static void purge_block(block_t *block) {
+
+    char *start;
+    char *end;
+
+    if (purge_range(block, &start, &end)
+        && madvise(start, (size_t)(end - start), MADV_DONTNEED) == 0) {
+        *get_stamp(block) = purged_stamp;
+    }
+}
+
+/*
+* purge_decayed purges every large free block of the arena that has been
+* free for decay_ms. heap_free and heap_find call it, and the index is
+* scanned at most every half decay time. Requires arena->lock.
+*/
+static void purge_decayed(arena_t *arena) {
+
+    word_t now = now_ms();
+    if (now < arena->next_purge) {
+        return;
+    }
+
+    word_t decay = __atomic_load_n(&decay_ms, __ATOMIC_RELAXED);
+    arena->next_purge = now + decay / 2;
+
+    // Blocks of purge_min_size bytes are all in the tree
+    block_t *node;
+    for (node = tree_lower_bound(arena, purge_min_size); node != NULL;
+         node = tree_successor(node)) {
+        for (block_t *block = node; block != NULL;
+             block = get_next(arena, block)) {
+            word_t stamp = *get_stamp(block);
+            if (stamp != purged_stamp && now - stamp >= decay) {
+                purge_block(block);
+            }
+        }
+    }
+}
+
+/*
+* trim_top cuts back a free block bordering the epilogue once it reaches
+* trim_threshold bytes, keeping chunksize bytes of it rounded up to a purge
+* granule. Arenas 1 and up lower their break and give the pages above it
+* back; arena 0 purges the block instead. Requires arena->lock.
+*/
+static void trim_top(arena_t *arena, block_t *block) {
+
+    size_t size = get_size(block);
+
+    if (get_alloc(block)
+        || size < __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED)
+        || get_size(find_next(block)) != 0) {
+        return;
+    }
+
+    if (arena->index == 0) {
+        if (!get_purged(block)) {
+            purge_block(block);
+            arena->grow_size = chunksize;
+        }
+        return;
+    }
+
+    size_t page = purge_granule();
+    char *old_brk = arena->region_brk;
+    char *new_brk = (char *)round_up((size_t)block + chunksize + wsize, page);
+
+    if (new_brk >= old_brk) {
+        return;
+    }
+
+    // The index is keyed by size, so unlink before the header changes
+    remove_from_free_list(arena, block);
+
+    int alloc_bit = extract_prev_alloc(block->header);
+    size_t new_size = (size_t)(new_brk - wsize - (char *)block);
+
+    write_header(block, new_size, false);
+    write_footer(block, new_size, false);
+    set_prev_alloc(block, alloc_bit);
+    write_header(find_next(block), 0, true);
+
+    prepend_to_free_list(arena, block);
+
+    madvise(new_brk, round_up((size_t)old_brk, page) - (size_t)new_brk,
+            MADV_DONTNEED);
+    arena->region_brk = new_brk;
+    heap_shrink((size_t)(old_brk - new_brk));
+    arena->grow_size = chunksize;
+
+    // Everything from the new break up is zero now
+    if (arena->clean_mark > new_brk) {
+        arena->clean_mark = new_brk;
+    }
+}
+
+// Slabs
+
+/*
+* slab_class maps a request of at most slab_max_size bytes to its slab class
+*/
+static size_t slab_class(size_t size) {
+    dbg_requires(size > 0 && size <= slab_max_size);
+    return (size - 1) / dsize;
+}
+
+/*
+* slab_of returns the slab holding bp if bp is a slab slot of the arena, and
+* NULL otherwise. It only reads the arena's slab map, never memory near bp.
+*/
+static slab_t *slab_of(arena_t *arena, void *bp) {
+
+    word_t *map = __atomic_load_n(&arena->slab_map, __ATOMIC_ACQUIRE);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    char *start = (char *)((size_t)bp & ~(SLAB_SIZE - 1));
+    size_t granule = (size_t)(start - arena->region_start) >> SLAB_SIZE_LOG2;
+
+    if (granule >= (arena_span >> SLAB_SIZE_LOG2)) {
+        return NULL;
+    }
+
+    word_t bits = __atomic_load_n(&map[granule / 64], __ATOMIC_RELAXED);
+    if (!((bits >> (granule % 64)) & 1)) {
+        return NULL;
+    }
+
+    return (slab_t *)start;
+}
+
+/*
+* slab_map_set records in the arena's slab map whether a slab starts where
+* slab does. Requires arena->lock.
+*/
+static void slab_map_set(arena_t *arena, slab_t *slab, bool state) {
+
+    size_t granule = (size_t)((char *)slab - arena->region_start)
+                     >> SLAB_SIZE_LOG2;
+    word_t bit = (word_t)1 << (granule % 64);
+
+    if (state) {
+        __atomic_fetch_or(&arena->slab_map[granule / 64], bit,
+                          __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&arena->slab_map[granule / 64], ~bit,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+/*
+* slab_create carves a new slab for a class out of the arena's heap and adds
+* it to the arena's list for that class. Returns NULL if the heap cannot
+* grow or the slab would fall outside the range covered by the slab map.
+* Requires arena->lock.
+*/
+static slab_t *slab_create(arena_t *arena, size_t class) {
+
+    if (arena->slab_map == NULL) {
+        void *map = mmap(NULL, arena_span >> (SLAB_SIZE_LOG2 + 3),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+        __atomic_store_n(&arena->slab_map, (word_t *)map, __ATOMIC_RELEASE);
+    }
+
+    // A block of exactly SLAB_SIZE lets the next slab follow without a gap
+    block_t *block = heap_malloc_aligned(arena, SLAB_SIZE, SLAB_SIZE);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    slab_t *slab = (slab_t *)header_to_payload(block);
+    if ((size_t)((char *)slab - arena->region_start) >= arena_span) {
+        heap_free(arena, block);
+        return NULL;
+    }
+
+    slab->slot_size = (uint32_t)((class + 1) * dsize);
+    slab->slot_count = (uint32_t)((get_payload_size(block) - sizeof(slab_t))
+                                  / slab->slot_size);
+    slab->free_count = slab->slot_count;
+    slab->slab_class = (uint32_t)class;
+
+    memset(slab->free_map, 0, sizeof(slab->free_map));
+    for (uint32_t i = 0; i < slab->slot_count; i++) {
+        slab->free_map[i / 64] |= (word_t)1 << (i % 64);
+    }
+
+    slab_link(arena, slab);
+    slab_map_set(arena, slab, true);
+
+    return slab;
+}
+
+/*
+* slab_alloc takes a free slot of the given class, creating a slab if none
+* has one. Returns NULL if no slab can be made. Requires arena->lock.
+*/
+static void *slab_alloc(arena_t *arena, size_t class) {
+
+    slab_t *slab = arena->slabs[class];
+
+    if (slab == NULL) {
+        slab = slab_create(arena, class);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t word = 0;
+    while (slab->free_map[word] == 0) {
+        word++;
+    }
+
+    size_t bit = (size_t)find_first_set(slab->free_map[word]);
+    slab->free_map[word] &= ~((word_t)1 << bit);
+
+    slab->free_count--;
+    if (slab->free_count == 0) {
+        slab_unlink(arena, slab);
+    }
+
+    return (char *)slab + sizeof(slab_t) + (word * 64 + bit) * slab->slot_size;
+}
+
+/*
+* slab_free marks the slot at bp free. A slab that becomes empty goes back to
+* the heap unless it is the only one of its class with free slots.
+* Requires arena->lock.
+*/
+static void slab_free(arena_t *arena, slab_t *slab, void *bp) {
+
+    size_t slot = (size_t)((char *)bp - ((char *)slab + sizeof(slab_t)))
+                  / slab->slot_size;
+    dbg_requires(!((slab->free_map[slot / 64] >> (slot % 64)) & 1));
+
+    slab->free_map[slot / 64] |= (word_t)1 << (slot % 64);
+    slab->free_count++;
+
+    if (slab->free_count == 1) {
+        slab_link(arena, slab);
+    }
+
+    if (slab->free_count == slab->slot_count
+        && (slab->prev != NULL || slab->next != NULL)) {
+        slab_unlink(arena, slab);
+        slab_map_set(arena, slab, false);
+        heap_free(arena, payload_to_header(slab));
+    }
+}
+
+/*
+* slab_link adds a slab at the head of its class list
+*/
+static void slab_link(arena_t *arena, slab_t *slab) {
+
+    slab_t *head = arena->slabs[slab->slab_class];
+
+    slab->prev = NULL;
+    slab->next = head;
+    if (head != NULL) {
+        head->prev = slab;
+    }
+    arena->slabs[slab->slab_class] = slab;
+}
+
+/*
+* slab_unlink removes a slab from its class list
+*/
+static void slab_unlink(arena_t *arena, slab_t *slab) {
+
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        arena->slabs[slab->slab_class] = slab->next;
+    }
+
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+// Quick Lists
+
+/*
+* quick_index maps a block size of at most quick_max_size to its quick list
+*/
+static size_t quick_index(size_t size) {
+    dbg_requires(size >= min_block_size && size <= quick_max_size);
+    return (size - min_block_size) / dsize;
+}
+
+/*
+* quick_get pops a block of exactly asize bytes from the quick lists, or
+* returns NULL. The block is still marked allocated, so it is handed out as
+* it is. Requires arena->lock.
+*/
+static block_t *quick_get(arena_t *arena, size_t asize) {
+
+    if (asize > quick_max_size) {
+        return NULL;
+    }
+
+    size_t i = quick_index(asize);
+    block_t *block = arena->quick_lists[i];
+
+    if (block != NULL) {
+        arena->quick_lists[i] = *(block_t **)block->payload;
+        arena->quick_bytes -= asize;
+    }
+    return block;
+}
+
+/*
+* quick_put pushes a freed block on the quick list of its size without
+* touching its neighbours, consolidating the lists once they hold
+* quick_max_bytes. Requires arena->lock.
+*/
+static void quick_put(arena_t *arena, block_t *block) {
+
+    size_t size = get_size(block);
+    size_t i = quick_index(size);
+
+    *(block_t **)block->payload = arena->quick_lists[i];
+    arena->quick_lists[i] = block;
+    arena->quick_bytes += size;
+
+    if (arena->quick_bytes >= quick_max_bytes) {
+        quick_consolidate(arena);
+    }
+}
+
+/*
+* quick_consolidate frees every block on the quick lists for real, letting
+* them coalesce. Requires arena->lock.
+*/
+static void quick_consolidate(arena_t *arena) {
+
+    for (size_t i = 0; i < QUICK_BIN_COUNT; i++) {
+        block_t *block = arena->quick_lists[i];
+        arena->quick_lists[i] = NULL;
+
+        while (block != NULL) {
+            block_t *next = *(block_t **)block->payload;
+            heap_free_now(arena, block);
+            block = next;
+        }
+    }
+    arena->quick_bytes = 0;
+}
+
+// Regions
+
+/*
+* region_grow starts a new chunk for the region to bump through, abandoning
+* what was left of the current one. Returns false if no chunk can be had.
+*/
+static bool region_grow(mm_region_t *region) {
+
+    size_t size = region->chunk_size;
+    region_chunk_t *chunk = malloc(sizeof(region_chunk_t) + size);
+    if (chunk == NULL) {
+        return false;
+    }
+
+    chunk->size = size;
+    chunk->next = region->chunks;
+    region->chunks = chunk;
+    region->top = chunk->data;
+    region->end = chunk->data + size;
+    region->chunk_size = min(2 * size, region_chunk_max);
+    return true;
+}
+
+/*
+* region_alloc_alone gives asize bytes a chunk of their own. It goes behind
+* the chunk being bumped through, which stays current.
+*/
+static void *region_alloc_alone(mm_region_t *region, size_t asize) {
+
+    if (asize > SIZE_MAX - sizeof(region_chunk_t)) {
+        return NULL;
+    }
+
+    region_chunk_t *chunk = malloc(sizeof(region_chunk_t) + asize);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->size = asize;
+    if (region->chunks == NULL) {
+        chunk->next = NULL;
+        region->chunks = chunk;
+    } else {
+        chunk->next = region->chunks->next;
+        region->chunks->next = chunk;
+    }
+    return chunk->data;
+}
+
+// Thread Cache
+
+/*
+* tcache_prepare returns the calling thread's cache, dropping blocks cached
+* from an earlier heap and registering the exit destructor on first use
+*/
+static tcache_t *tcache_prepare(void) {
 
-        prepend_to_free_list(left);
-        return left;
+    tcache_t *tc = &tcache;
 
-   } else if(isRightFree) {
+    if (tc->generation != heap_generation) {
+        memset(tc->bins, 0, sizeof(tc->bins));
+        memset(tc->counts, 0, sizeof(tc->counts));
+        tc->generation = heap_generation;
+    }
 
-        rightSize = get_size(right);
+    if (!tc->registered) {
+        // pthread_setspecific may calloc, which comes back here
+        tc->registered = true;
+        pthread_once(&tcache_key_once, tcache_key_create);
+        pthread_setspecific(tcache_key, tc);
+
+        pthread_mutex_lock(&stats_lock);
+        tc->prev = NULL;
+        tc->next = stats_threads;
+        if (stats_threads != NULL) {
+            stats_threads->prev = tc;
+        }
+        stats_threads = tc;
+        pthread_mutex_unlock(&stats_lock);
+    }
 
-        // setting prev_alloc of next to reflect the current free operation
-        set_prev_alloc(find_next(right), false);
+    return tc;
+}
 
-        remove_from_free_list(right);
+/*
+* tcache_key_create creates the key whose destructor flushes exiting threads
+*/
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
 
-        // retain prev_alloc of current block
-        size_t alloc_bit = extract_prev_alloc(block->header);
+/*
+* tcache_destroy returns every block cached by an exiting thread to the heap
+* and keeps its counters with those of other exited threads
+*/
+static void tcache_destroy(void *arg) {
 
-        write_header(block, blockSize+rightSize,false);
-        write_footer(block, blockSize+rightSize,false);
+    tcache_t *tc = (tcache_t *)arg;
 
-        // Carry prev_alloc of current block
-        set_prev_alloc(block, alloc_bit);
+    if (tc->generation == heap_generation) {
+        for (size_t i = 0; i < TCACHE_BIN_COUNT; i++) {
+            tcache_flush(tc, i, tc->counts[i]);
+        }
+    }
 
-        prepend_to_free_list(block);
-        return block;
+    pthread_mutex_lock(&stats_lock);
+    stats_merge(&retired_stats, &tc->stats);
+    memset(&tc->stats, 0, sizeof(tc->stats));
+    if (tc->prev != NULL) {
+        tc->prev->next = tc->next;
+    } else {
+        stats_threads = tc->next;
+    }
+    if (tc->next != NULL) {
+        tc->next->prev = tc->prev;
+    }
+    pthread_mutex_unlock(&stats_lock);
 
-   } else {
-        
-        prepend_to_free_list(block);
+    tc->registered = false;
+}
 
-         // setting prev_alloc of next to reflect the current free operation
-         set_prev_alloc(right, false);
-         
+/*
+* tcache_index maps a small block size to its bin
+*/
+static size_t tcache_index(size_t asize) {
+    dbg_requires(asize >= min_block_size && asize <= tcache_max_size);
+    return (asize - min_block_size) / dsize;
+}
 
-        return block;
-   }
-   
+/*
+* tcache_slab_index maps a slab class to its bin
+*/
+static size_t tcache_slab_index(size_t class) {
+    dbg_requires(class < SLAB_CLASS_COUNT);
+    return TCACHE_BLOCK_BIN_COUNT + class;
 }
 
 /*
- * place writes to the block passes as the parameter. If the payload leaves  
- * space within that block, the rest of the block is split and marked as 
- * unallocated.
- */
-static void place(block_t *block, size_t asize)
-{
-    size_t csize = get_size(block);
+* tcache_get pops a cached payload from a bin, or returns NULL
+*/
+static void *tcache_get(size_t i) {
 
-    if ((csize - asize) >= min_block_size)
-    {
-        // retaining prev_alloc for the first block
-        int alloc_bit = extract_prev_alloc(block->header);
+    tcache_t *tc = tcache_prepare();
 
-        write_header(block, asize, true);
-        //write_footer(block, asize, true);
+    void *bp = tc->bins[i];
+    if (bp != NULL) {
+        tc->bins[i] = *(void **)bp;
+        tc->counts[i]--;
+    }
+    return bp;
+}
 
-        // carry prev_alloc for first block
-        set_prev_alloc(block, alloc_bit);
+/*
+* tcache_refill allocates tcache_batch blocks or slots for a bin under one
+* lock, returns the first and caches the rest. Returns NULL if none could be
+* made.
+*/
+static void *tcache_refill(size_t i) {
 
-        remove_from_free_list(block);
+    tcache_t *tc = tcache_prepare();
+    void *bp = NULL;
 
-        block_t *block_next;
-        block_next = find_next(block);
-        write_header(block_next, csize-asize, false);
-        write_footer(block_next, csize-asize, false);
-        set_prev_alloc(block_next, true);
-        coalesce(block_next);
-    
-    }
-    else
-    { 
-        
-        // retaining prev_alloc for the current block
-        int alloc_bit = extract_prev_alloc(block->header);
+    arena_t *arena = arena_get();
 
-        write_header(block, csize, true);
-        //write_footer(block, csize, true);
+    pthread_mutex_lock(&arena->lock);
+    for (unsigned n = 0; n < tcache_batch; n++) {
+        void *cached;
 
-        // carry prev_alloc for current block
-        set_prev_alloc(block, alloc_bit);
+        if (i >= TCACHE_BLOCK_BIN_COUNT) {
+            cached = slab_alloc(arena, i - TCACHE_BLOCK_BIN_COUNT);
+        } else {
+            block_t *block = heap_malloc(arena, min_block_size + i * dsize);
+            cached = (block == NULL) ? NULL : header_to_payload(block);
+        }
 
-        // setting prev_alloc of next to reflect the current free operation
-         set_prev_alloc(find_next(block), true);
+        if (cached == NULL) {
+            break;
+        }
 
-        remove_from_free_list(block);
+        if (bp == NULL) {
+            bp = cached;
+        } else {
+            *(void **)cached = tc->bins[i];
+            tc->bins[i] = cached;
+            tc->counts[i]++;
+        }
     }
+    pthread_mutex_unlock(&arena->lock);
+
+    return bp;
 }
 
 /*
- * find_fit implements an nth fit policy. The heap is searched for n free blocks
- * that can accomodate the payload. The block that fits the best is returned.
- */
-static block_t *find_fit(size_t asize)
-{
-    block_t *block;
-    block_t * smallestFit = NULL;
-    
-    int n = 0;
-    for (block = free_start; block != NULL;
-                             block = block->next)
-    {
-        // if we find a fit
-        if (!(get_alloc(block)) && (asize <= get_size(block)))
-        {
-            n++;
-            if (smallestFit != NULL) {
-                if (extract_size((smallestFit)->header) 
-                    > extract_size((block)->header)) {
-                    smallestFit = block;
-                }
-            } else {
-                smallestFit = block;
-            }
+* tcache_put caches a freed payload in a bin, flushing part of the bin back
+* to the heap once it holds more than tcache_bin_max payloads
+*/
+static void tcache_put(void *bp, size_t i) {
 
-            if (n>=18) {
-                break; 
-            }
-        }
-    }
+    tcache_t *tc = tcache_prepare();
 
-    return smallestFit;
-}
+    *(void **)bp = tc->bins[i];
+    tc->bins[i] = bp;
+    tc->counts[i]++;
 
-/* 
- * The heap checker verifies that certain heap invariants have not been violated
- * It calls an assortment of helper function for modularity.
- */
-bool mm_checkheap(int line)  
-{ 
-    // Coalesce: Making sure there are no adjacent free blocks
-    if (!no_adjacent_free_blocks()) {
-        printf("Line %d: Two adjacent free blocks!\n", line);
-        return false;
+    if (tc->counts[i] > tcache_bin_max) {
+        tcache_flush(tc, i, tcache_batch);
     }
+}
 
-    // Explicit List: Making sure there are no cycles in free doubly linked list
-    if (!detect_cycle()) {
-        printf("Line %d: Cycle in free list!\n", line);
-        return false;
-    }
+/*
+* tcache_flush frees count blocks from the head of a bin under the calling
+* thread's arena lock, and queues blocks owned by other arenas to them
+*/
+static void tcache_flush(tcache_t *tc, size_t index, unsigned count) {
 
-    // Explicit List: Making sure explicit list matches implicit list
-    if (!correct_num_free_blocks()) {
-        printf("Line %d: Explicit-Implicit Count Mismatch!\n", line);
-        return false;
-    }
+    arena_t *own = arena_get();
+    bool locked = false;
 
-    // Removing Footers: Checking that prev alloc bits are correct
-        if (!checkAllPrevAllocBits()) {
-        printf("Line %d: Prev alloc bit mismatch!\n", line);
-        return false;
+    while (count > 0 && tc->bins[index] != NULL) {
+        void *bp = tc->bins[index];
+        tc->bins[index] = *(void **)bp;
+        tc->counts[index]--;
+        count--;
+
+        arena_t *arena = arena_of(bp);
+        if (arena != own) {
+            remote_free_push(arena, bp);
+            continue;
+        }
+
+        if (!locked) {
+            pthread_mutex_lock(&own->lock);
+            locked = true;
+        }
+        arena_free(own, bp);
     }
 
-    return true;
+    if (locked) {
+        pthread_mutex_unlock(&own->lock);
+    }
 }
 
+// Statistics
+
 /*
- * max: returns x if x > y, and y otherwise.
- */
-static size_t max(size_t x, size_t y)
-{
-    return (x > y) ? x : y;
+* stats_local returns the calling thread's counters
+*/
+static thread_stats_t *stats_local(void) {
+    return &tcache_prepare()->stats;
 }
 
 /*
- * round_up: Rounds size up to next multiple of n
- */
-static size_t round_up(size_t size, size_t n)
-{
-    return (n * ((size + (n-1)) / n));
+* stat_add adds n to one of the calling thread's counters. The store is
+* atomic only so that mm_stats may read it from another thread.
+*/
+static void stat_add(word_t *counter, word_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
 }
 
 /*
- * pack: returns a header reflecting a specified size and its alloc status.
- *       If the block is allocated, the lowest bit is set to 1, and 0 otherwise.
- */
-static word_t pack(size_t size, bool alloc)
-{
-    return alloc ? (size | alloc_mask) : size;
-}
+* stats_class maps a block size to its mm_stats size class
+*/
+static size_t stats_class(size_t size) {
 
+    if (size <= dsize) {
+        return 0;
+    }
 
-/*
- * extract_size: returns the size of a given header value based on the header
- *               specification above.
- */
-static size_t extract_size(word_t word)
-{
-    return (word & size_mask);
+    size_t class = (size_t)find_last_set(size - 1) - 3;
+    return (class < MM_STATS_CLASS_COUNT) ? class
+                                          : MM_STATS_CLASS_COUNT - 1;
 }
 
 /*
- * get_size: returns the size of a given block by clearing the lowest 4 bits
- *           (as the heap is 16-byte aligned).
- */
-static size_t get_size(block_t *block)
-{
-    return extract_size(block->header);
-}
+* stats_alloc counts a block of size bytes handed out to the caller
+*/
+static void stats_alloc(size_t size) {
 
-/*
- * get_payload_size: returns the payload size of a given block, equal to
- *                   the entire block size minus the header and footer sizes.
- */
-static word_t get_payload_size(block_t *block)
-{
-    size_t asize = get_size(block);
-    return asize - wsize;
+    thread_stats_t *stats = stats_local();
+
+    stat_add(&stats->alloc_bytes, size);
+    stat_add(&stats->allocs[stats_class(size)], 1);
 }
 
 /*
- * extract_alloc: returns the allocation status of a given header value based
- *                on the header specification above.
- */
-static bool extract_alloc(word_t word)
-{
-    return (bool)(word & alloc_mask);
-}
+* stats_free counts a block of size bytes given back by the caller
+*/
+static void stats_free(size_t size) {
 
-static size_t extract_prev_alloc(word_t word)
-{
-    size_t alloc_bit = (word & prev_alloc_mask);
-    return alloc_bit;
+    thread_stats_t *stats = stats_local();
+
+    stat_add(&stats->free_bytes, size);
+    stat_add(&stats->frees[stats_class(size)], 1);
 }
 
-static void set_prev_alloc(block_t * block, bool state) {
+/*
+* stats_fit counts a fit search by the number of candidates it examined
+*/
+static void stats_fit(unsigned candidates) {
 
-    if (block != NULL) {
-        if (state==true) {
-            block->header = (block->header | prev_alloc_mask);
+    size_t bucket = 0;
 
-        } else {
-            block->header = (block->header & ~(prev_alloc_mask));
+    if (candidates > 0) {
+        bucket = (size_t)find_last_set(candidates) + 1;
+        if (bucket >= MM_STATS_FIT_BUCKETS) {
+            bucket = MM_STATS_FIT_BUCKETS - 1;
         }
     }
-
+    stat_add(&stats_local()->fit_searches[bucket], 1);
 }
 
 /*
- * get_alloc: returns true when the block is allocated based on the
- *            block header's lowest bit, and false otherwise.
- */
-static bool get_alloc(block_t *block)
-{
-    return extract_alloc(block->header);
+* stats_merge adds the counters of from to those of into
+*/
+static void stats_merge(thread_stats_t *into, thread_stats_t *from) {
+
+    word_t *dst = (word_t *)into;
+    word_t *src = (word_t *)from;
+
+    for (size_t i = 0; i < sizeof(thread_stats_t) / sizeof(word_t); i++) {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
 }
 
 /*
- * write_header: given a block and its size and allocation status,
- *               writes an appropriate value to the block header.
- */
-static void write_header(block_t *block, size_t size, bool alloc)
-{
-    block->header = pack(size, alloc);
-}
+* heap_grow counts bytes added to a heap region or mapped, raising the peak
+*/
+static void heap_grow(size_t bytes) {
+
+    size_t now = __atomic_add_fetch(&heap_bytes, bytes, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_heap_bytes, __ATOMIC_RELAXED);
 
+    while (now > peak
+           && !__atomic_compare_exchange_n(&peak_heap_bytes, &peak, now, true,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED)) {
+    }
+}
 
 /*
- * write_footer: given a block and its size and allocation status,
- *               writes an appropriate value to the block footer by first
- *               computing the position of the footer.
- */
-static void write_footer(block_t *block, size_t size, bool alloc)
-{
-    word_t *footerp = (word_t *)((block->payload) + get_size(block) - dsize);
-    *footerp = pack(size, alloc);
+* heap_shrink counts bytes taken off a heap region or unmapped
+*/
+static void heap_shrink(size_t bytes) {
+    __atomic_sub_fetch(&heap_bytes, bytes, __ATOMIC_RELAXED);
 }
 
+// Heap Profile
 
 /*
- * find_next: returns the next consecutive block on the heap by adding the
- *            size of the block.
- */
-static block_t *find_next(block_t *block)
-{
-    dbg_requires(block != NULL);
-    block_t *block_next = (block_t *)(((char *)block) + get_size(block));
+* profile_tick counts size bytes against the calling thread's countdown and
+* returns true when the request is due to be sampled. It is the only cost the
+* profiler adds to an allocation that is not sampled.
+*/
+static bool profile_tick(size_t size) {
 
-    dbg_ensures(block_next != NULL);
-    return block_next;
+    int64_t countdown = __atomic_load_n(&tcache.profile_countdown,
+                                        __ATOMIC_RELAXED) - (int64_t)size;
+    __atomic_store_n(&tcache.profile_countdown, countdown, __ATOMIC_RELAXED);
+    return countdown < 0;
 }
 
 /*
- * find_prev_footer: returns the footer of the previous block.
- */
-static word_t *find_prev_footer(block_t *block)
-{
-    // Compute previous footer position as one word before the header
-    return (&(block->header)) - 1;
-}
+* profile_malloc serves a request whose countdown ran out, for a payload
+* aligned to align: dsize for malloc, more for memalign. If profiling is on,
+* the block is allocated with a header, however small the request, and
+* recorded along with the stack that asked for it. Either way the countdown
+* starts over.
+*/
+static void *profile_malloc(size_t size, size_t align) {
 
-/*
- * find_prev: returns the previous block position by checking the previous
- *            block's footer and calculating the start of the previous block
- *            based on its size.
- */
-static block_t *find_prev(block_t *block)
-{
-    word_t *footerp = find_prev_footer(block);
-    size_t size = extract_size(*footerp);
-    return (block_t *)((char *)block - size);
-}
+    tcache_t *tc = &tcache;
+    size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+
+    // Allocations made while recording a sample are never sampled themselves
+    if (tc->profiling) {
+        return (align > dsize) ? allocate_aligned(size, align)
+                               : allocate(size);
+    }
+
+    __atomic_store_n(&tc->profile_countdown, profile_interval(tc, rate),
+                     __ATOMIC_RELAXED);
+    if (rate == 0 || size == 0) {
+        return (align > dsize) ? allocate_aligned(size, align)
+                               : allocate(size);
+    }
+
+    // Slab slots have no header to carry sampled_mask; aligned blocks are
+    // never slots
+    void *bp = (align > dsize) ? allocate_aligned(size, align)
+                               : allocate(max(size, slab_max_size + 1));
+    if (bp == NULL) {
+        return NULL;
+    }
 
-/*
- * payload_to_header: given a payload pointer, returns a pointer to the
- *                    corresponding block.
- */
-static block_t *payload_to_header(void *bp)
-{
-    return (block_t *)(((char *)bp) - offsetof(block_t, payload));
+    void *pcs[PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES];
+
+    // backtrace may allocate the first time it runs
+    tc->profiling = true;
+    int depth = backtrace(pcs, PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES);
+    tc->profiling = false;
+
+    depth = (depth > PROFILE_SKIP_FRAMES) ? depth - PROFILE_SKIP_FRAMES : 0;
+    profile_record(bp, size, pcs + PROFILE_SKIP_FRAMES, depth);
+    return bp;
 }
 
 /*
- * header_to_payload: given a block pointer, returns a pointer to the
- *                    corresponding payload.
- */
-static void *header_to_payload(block_t *block)
-{
-    return (void *)(block->payload);
+* profile_interval draws the bytes to allocate before the next sample from an
+* exponential distribution of mean rate, or returns profile_recheck_bytes when
+* profiling is off
+*/
+static int64_t profile_interval(tcache_t *tc, size_t rate) {
+
+    if (rate == 0) {
+        return profile_recheck_bytes;
+    }
+
+    // xorshift64*, seeded from the thread's cache address and the time
+    word_t x = tc->profile_random;
+    if (x == 0) {
+        x = ((word_t)(uintptr_t)tc ^ (now_ms() << 32)) | 1;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    tc->profile_random = x;
+
+    // 53 random bits make a uniform in (0, 1]
+    double uniform = (double)(((x * 0x2545F4914F6CDD1DULL) >> 11) + 1)
+                     / (double)((word_t)1 << 53);
+    double interval = -log(uniform) * (double)rate;
+
+    if (interval >= (double)profile_recheck_bytes) {
+        return profile_recheck_bytes;
+    }
+    return (int64_t)interval;
 }
 
 /*
-* Helper function that prints all the blocks in the implicit list along with 
-* their size, allocation and potentially their prev and next pointers if they
-* are free
+* profile_record adds a freshly allocated block of size requested bytes to the
+* profile under the stack that allocated it, and marks the block sampled.
+* Samples that cannot be stored are dropped.
 */
-static void print_blocks() {
+static void profile_record(void *bp, size_t size, void **pcs, int depth) {
 
-    block_t * current = heap_start;
+    pthread_mutex_lock(&profile_lock);
 
-    word_t * prologueFooter = find_prev_footer(current);
-    size_t PF_size = extract_size(*prologueFooter);
-    bool PF_alloc = extract_alloc(*prologueFooter);
+    profile_stack_t *stack = profile_stack_get(pcs, depth);
+    profile_sample_t *sample = profile_unused;
 
-    printf("%s %s %zu %s %d\n", 
-            "prologue footer","size:", PF_size, "alloc:", PF_alloc);
+    if (sample != NULL) {
+        profile_unused = sample->next;
+    } else {
+        sample = profile_carve(sizeof(profile_sample_t));
+    }
 
-    size_t size = extract_size((current)->header);
-    bool alloc = extract_alloc((current)->header);
+    if (stack == NULL || sample == NULL) {
+        if (sample != NULL) {
+            sample->next = profile_unused;
+            profile_unused = sample;
+        }
+        pthread_mutex_unlock(&profile_lock);
+        return;
+    }
 
-    int count = 0;
+    size_t bucket = ((uintptr_t)bp >> 4) % PROFILE_SAMPLE_BUCKETS;
 
-    // while we haven't reached the epilogue header block
-    while(!(size==0 && alloc==1)) {
-        
-        printf("%s %p ", "Block", current);
-        printf("%s: %zu ","Size",size);
-        printf("%s: %d ","Alloc",alloc);
+    sample->bp = bp;
+    sample->size = size;
+    sample->stack = stack;
+    sample->next = profile_samples[bucket];
+    profile_samples[bucket] = sample;
 
-        if (alloc == 0) {
-            if (current->prev == NULL) {
-                printf("%s: %s ","Prev", "null");
-            } else {
-                printf("%s: %p ","Prev", current->prev);
-            }
+    stack->alloc_count++;
+    stack->alloc_bytes += size;
+    stack->live_count++;
+    stack->live_bytes += size;
 
-            if (current->next == NULL) {
-                printf("%s: %s ","Next", "null");
-            } else {
-                printf("%s: %p ","Next", current->next);
-            }
+    pthread_mutex_unlock(&profile_lock);
 
-        } else {
-            printf("%s: %s ","Prev", "PAYLOAD");
-            printf("%s: %s ","Next", "PAYLOAD");
+    payload_to_header(bp)->header |= sampled_mask;
+}
 
-        }
+/*
+* profile_forget takes a sampled block out of the live heap profile, before
+* it is freed or resized, and clears its mark so that the block can be
+* cached and handed out again unsampled
+*/
+static void profile_forget(void *bp) {
 
-        size_t alloc_bit = extract_prev_alloc(current->header);
-        printf("%s %zu", "Prev Alloc:", alloc_bit);
+    size_t bucket = ((uintptr_t)bp >> 4) % PROFILE_SAMPLE_BUCKETS;
 
-        if (current == free_start) {
-            printf("<- free start\n");
-        } else {
-            printf("\n");
-            }
+    pthread_mutex_lock(&profile_lock);
 
-        count++;
-        current = find_next(current);
-        size = extract_size((current)->header);
-        alloc = extract_alloc((current)->header);
+    profile_sample_t **link = &profile_samples[bucket];
+    while (*link != NULL && (*link)->bp != bp) {
+        link = &(*link)->next;
     }
 
-    block_t * epilogueHeader = current;
-    size_t EH_size = extract_size((epilogueHeader)->header);
-    bool EH_alloc = extract_alloc((epilogueHeader)->header);
+    // mm_init drops the samples of an earlier heap
+    profile_sample_t *sample = *link;
+    if (sample != NULL) {
+        *link = sample->next;
+        sample->stack->live_count--;
+        sample->stack->live_bytes -= sample->size;
+        sample->next = profile_unused;
+        profile_unused = sample;
+    }
 
-    printf("%s %s %zu %s %d\n", 
-            "epilogue header","size:", EH_size, "alloc:", EH_alloc);
-    printf("\n");
+    pthread_mutex_unlock(&profile_lock);
 
+    payload_to_header(bp)->header &= ~sampled_mask;
 }
 
 /*
-* Helper function that strictly prints all free blocks along with their prev
-* and next pointers
+* profile_move keeps the sample of a block realloc resized at bp under newbp,
+* which may be bp itself, with size as its requested size, and marks the
+* block at newbp sampled. The old block is not touched: it may be gone.
 */
-static void print_free_list() {
-    printf("free list: ");
-    
-    block_t * current = free_start;
-    int count = 0;
-    printf("%p -> ", current);
+static void profile_move(void *bp, void *newbp, size_t size) {
 
-    while (current != NULL) {
-        if (count > 10) {
-            break;
-        }
-        printf("%p ->", current->next);
-        count++;
+    size_t bucket = ((uintptr_t)bp >> 4) % PROFILE_SAMPLE_BUCKETS;
+
+    pthread_mutex_lock(&profile_lock);
 
-        current = current->next;
+    profile_sample_t **link = &profile_samples[bucket];
+    while (*link != NULL && (*link)->bp != bp) {
+        link = &(*link)->next;
+    }
+
+    // mm_init drops the samples of an earlier heap
+    profile_sample_t *sample = *link;
+    if (sample != NULL) {
+        *link = sample->next;
+        sample->stack->live_bytes += size - sample->size;
+        sample->bp = newbp;
+        sample->size = size;
+
+        bucket = ((uintptr_t)newbp >> 4) % PROFILE_SAMPLE_BUCKETS;
+        sample->next = profile_samples[bucket];
+        profile_samples[bucket] = sample;
     }
-    printf("\n");
 
+    pthread_mutex_unlock(&profile_lock);
 
+    if (sample != NULL) {
+        payload_to_header(newbp)->header |= sampled_mask;
+    }
 }
 
 /*
-* prepend_to_free_list takes a pointer to a block that it proceeds to insert 
-* into the free list. This new block is now the head of the list (free_start)
+* get_sampled: returns true when an allocated block is in the heap profile
+*/
+static bool get_sampled(block_t *block) {
+    return (block->header & sampled_mask) != 0;
+}
+
+/*
+* profile_stack_get returns the entry of a call stack, adding it if it is
+* new. Returns NULL if no room is left for it. Requires profile_lock.
 */
-static void prepend_to_free_list(block_t * block) {
+static profile_stack_t *profile_stack_get(void **pcs, int depth) {
 
-    if (free_start==NULL) {
-        block->prev = NULL;
-        block->next = NULL;
-        free_start = block;
-    } else {
-        block->prev = NULL;
-        block->next = free_start;
-        free_start->prev = block;
-        free_start = block;
+    // FNV-1a over the return addresses
+    word_t hash = 0xCBF29CE484222325ULL;
+    for (int d = 0; d < depth; d++) {
+        hash = (hash ^ (word_t)(uintptr_t)pcs[d]) * 0x100000001B3ULL;
+    }
+
+    size_t bucket = hash % PROFILE_STACK_BUCKETS;
+    profile_stack_t *stack;
+
+    for (stack = profile_stacks[bucket]; stack != NULL; stack = stack->next) {
+        if (stack->hash == hash && stack->depth == depth
+            && memcmp(stack->pcs, pcs, (size_t)depth * sizeof(void *)) == 0) {
+            return stack;
+        }
     }
 
+    stack = profile_carve(sizeof(profile_stack_t));
+    if (stack == NULL) {
+        return NULL;
+    }
+
+    stack->hash = hash;
+    stack->depth = depth;
+    memcpy(stack->pcs, pcs, (size_t)depth * sizeof(void *));
+    stack->next = profile_stacks[bucket];
+    profile_stacks[bucket] = stack;
+    return stack;
 }
 
 /*
-* remove_from+free_list takes a pointer to a block that it proceeds to remove 
-* from the free list by redirecting the prev and next pointers of the blocks to
-* its left and right
+* profile_carve returns size bytes of zeroed memory for the profile's own
+* tables, mapping a new pool when the current one is used up. The profile
+* never takes memory from the heap it describes. Requires profile_lock.
 */
-static void remove_from_free_list(block_t * block) {
+static void *profile_carve(size_t size) {
 
-    if (free_start == NULL) {
-        return;
-    }
+    size = round_up(size, dsize);
 
-    block_t * prev = block->prev;
-    block_t * next = block->next;
+    if (profile_pool == NULL
+        || size > (size_t)(profile_pool_end - profile_pool_next)) {
+        char *pool = mmap(NULL, profile_pool_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool == MAP_FAILED) {
+            return NULL;
+        }
 
-    if (prev == NULL && next == NULL) {
-        free_start = NULL;
-    }
-    else if (prev == NULL && next != NULL) {
-        free_start = next;
-        free_start->prev = NULL;
+        // Chain the pools in the order they were made
+        if (profile_pool == NULL) {
+            profile_pool_first = pool;
+        } else {
+            *(char **)profile_pool = pool;
+        }
+        profile_pool = pool;
+        profile_pool_next = pool + dsize;
+        profile_pool_end = pool + profile_pool_size;
     }
-    else if (prev != NULL && next == NULL) {
-        (block->prev)->next = NULL;
+
+    void *p = profile_pool_next;
+    profile_pool_next += size;
+    return p;
+}
+
+/*
+* profile_reset empties the heap profile and unmaps its pools, for a new heap
+*/
+static void profile_reset(void) {
+
+    pthread_mutex_lock(&profile_lock);
+
+    char *pool = profile_pool_first;
+    while (pool != NULL) {
+        char *next = *(char **)pool;
+        munmap(pool, profile_pool_size);
+        pool = next;
     }
-    else if (prev != NULL && next != NULL) {
-        prev->next = next;
-        next->prev = prev;
 
+    profile_pool_first = NULL;
+    profile_pool = NULL;
+    profile_pool_next = NULL;
+    profile_pool_end = NULL;
+    profile_unused = NULL;
+    memset(profile_stacks, 0, sizeof(profile_stacks));
+    memset(profile_samples, 0, sizeof(profile_samples));
+
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+* profile_write writes all of text to fd, resuming after partial writes.
+* Returns false on error.
+*/
+static bool profile_write(int fd, const char *text, size_t length) {
+
+    while (length > 0) {
+        ssize_t done = write(fd, text, length);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        text += done;
+        length -= (size_t)done;
     }
- 
+    return true;
 }
 
 // Heap Checks
@@ -928,9 +5683,9 @@ static void remove_from_free_list(block_t * block) {
 * Makes sure that there do not exist any adjacent free blocks as they must have
 * been coalesced
 */
-static bool no_adjacent_free_blocks() {
+static bool no_adjacent_free_blocks(arena_t *arena) {
 
-    block_t * current = heap_start;
+    block_t * current = arena->heap_start;
     size_t size = extract_size((current)->header);
     bool alloc = extract_alloc((current)->header);
 
@@ -954,12 +5709,12 @@ static bool no_adjacent_free_blocks() {
 * Makes sure that the number of blocks marked as unallocated in the implicit 
 * list are equal to the number of blocks in the free list
 */
-static bool correct_num_free_blocks() {
+static bool correct_num_free_blocks(arena_t *arena) {
 
     int implicit_count = 0;
     int explicit_count = 0;
 
-    block_t * implicit_current = heap_start;
+    block_t * implicit_current = arena->heap_start;
     size_t size = extract_size((implicit_current)->header);
     bool alloc = extract_alloc((implicit_current)->header);
 
@@ -974,50 +5729,305 @@ static bool correct_num_free_blocks() {
         alloc = extract_alloc((implicit_current)->header);
     }
 
-    block_t * explicit_current = free_start;
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++) {
+        for (int sl = 0; sl < SL_INDEX_COUNT; sl++) {
+            block_t * explicit_current = arena->free_lists[fl][sl];
+
+            while (explicit_current != NULL) {
+                explicit_count++;
+                explicit_current = get_next(arena, explicit_current);
+            }
+        }
+    }
 
-    while (explicit_current != NULL) {
-        explicit_count++;
-        explicit_current = explicit_current->next;
+    for (block_t * node = tree_lower_bound(arena, 0); node != NULL;
+         node = tree_successor(node)) {
+        for (block_t * block = node; block != NULL;
+             block = get_next(arena, block)) {
+            explicit_count++;
+        }
     }
 
     if (explicit_count == implicit_count) {
         return 1;
     }
 
+    return 0;
+
+
+}
+
+/*
+* Makes sure none of the doubly linked free lists contains a cycle
+*/
+static bool no_free_list_cycles(arena_t *arena) {
+
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++) {
+        for (int sl = 0; sl < SL_INDEX_COUNT; sl++) {
+
+            block_t * slow = arena->free_lists[fl][sl];
+            block_t * fast = arena->free_lists[fl][sl];
+
+            while (slow && fast && get_next(arena, fast)) {
+                slow = get_next(arena, slow);
+                fast = get_next(arena, get_next(arena, fast));
+                if (slow == fast) {
+                    printf("====== Found Cycle ======\n");
+                    return 0;
+                }
+            }
+        }
+    }
+
+    return 1;
+
+}
+
+/*
+* Makes sure that the bitmaps agree with the free lists, that every listed
+* block is free and filed under its size class, that prev pointers mirror
+* next pointers, and that lists are in address order under INSERT_ADDRESS
+*/
+static bool free_index_consistent(arena_t *arena) {
+
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++) {
+
+        bool fl_set = (arena->fl_bitmap >> fl) & 1;
+        if (fl_set != (arena->sl_bitmap[fl] != 0)) {
+            printf("first level bit %d does not match its classes\n", fl);
+            return 0;
+        }
+
+        for (int sl = 0; sl < SL_INDEX_COUNT; sl++) {
+
+            block_t * current = arena->free_lists[fl][sl];
+            bool sl_set = (arena->sl_bitmap[fl] >> sl) & 1;
+
+            if (sl_set != (current != NULL)) {
+                printf("class [%d][%d] bit does not match its list\n", fl, sl);
+                return 0;
+            }
+
+            block_t * prev = NULL;
+            while (current != NULL) {
+                int block_fl, block_sl;
+                mapping_insert(get_size(current), &block_fl, &block_sl);
+
+                if (get_alloc(current) || get_prev(arena, current) != prev
+                    || block_fl != fl || block_sl != sl
+                    || (insert_policy == INSERT_ADDRESS && prev > current)) {
+                    printf("bad free block %p in class [%d][%d]\n",
+                           current, fl, sl);
+                    return 0;
+                }
+
+                prev = current;
+                current = get_next(arena, current);
+            }
+        }
+    }
+
+    return 1;
+
+}
+
+/*
+* Makes sure that the tree of large blocks is a red-black tree ordered by
+* size, and that every chain holds free blocks of its node's size
+*/
+static bool tree_consistent(arena_t *arena) {
+
+    if (tree_red(arena->tree_root)) {
+        printf("red tree root\n");
+        return 0;
+    }
+    if (tree_black_height(arena, arena->tree_root, NULL) < 0) {
+        return 0;
+    }
+
+    size_t last = 0;
+    for (block_t * node = tree_lower_bound(arena, 0); node != NULL;
+         node = tree_successor(node)) {
+        if (get_size(node) <= last) {
+            printf("tree node %p out of order\n", node);
+            return 0;
+        }
+        last = get_size(node);
+    }
+
+    return 1;
+
+}
+
+/*
+* Makes sure that under FIT_INDEX the size index holds exactly the free
+* blocks it should, each with its size and its own position, and that the
+* sizes past the last entry are zero
+*/
+static bool size_index_consistent(arena_t *arena) {
+
+    if (fit_policy != FIT_INDEX || arena->index_dropped) {
+        return 1;
+    }
+
+    for (uint32_t pos = 0; pos < arena->index_capacity; pos++) {
+
+        if (pos >= arena->index_count) {
+            if (arena->index_sizes[pos] != 0) {
+                printf("size index entry %u is past the end\n", pos);
+                return 0;
+            }
+            continue;
+        }
+
+        block_t * block = decode_link(arena, arena->index_links[pos]);
+        if (get_alloc(block) || get_size(block) != arena->index_sizes[pos]
+            || get_size(block) <= min_block_size
+            || get_size(block) >= tree_min_size
+            || *get_index_slot(block) != pos) {
+            printf("bad size index entry %u for block %p\n", pos, block);
+            return 0;
+        }
+    }
+
+    // Every free block in range is indexed
+    uint32_t count = 0;
+    for (block_t * block = arena->heap_start; get_size(block) > 0;
+         block = find_next(block)) {
+        if (!get_alloc(block) && get_size(block) > min_block_size
+            && get_size(block) < tree_min_size) {
+            count++;
+        }
+    }
+
+    if (count != arena->index_count) {
+        printf("size index holds %u blocks, not %u\n",
+               arena->index_count, count);
+        return 0;
+    }
+
     return 1;
 
+}
+
+/*
+* Returns the number of black nodes on every path down from node, or -1 if
+* the paths disagree or a node is malformed
+*/
+static int tree_black_height(arena_t *arena, block_t *node,
+                             block_t *parent) {
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    tree_links_t * nt = get_tree(node);
+
+    if (get_alloc(node) || get_size(node) < tree_min_size
+        || nt->parent != parent || get_prev(arena, node) != NULL
+        || (nt->color != TREE_RED && nt->color != TREE_BLACK)
+        || (nt->color == TREE_RED && tree_red(parent))) {
+        printf("bad tree node %p\n", node);
+        return -1;
+    }
+
+    for (block_t * block = get_next(arena, node), * prev = node; block != NULL;
+         prev = block, block = get_next(arena, block)) {
+        if (get_alloc(block) || get_size(block) != get_size(node)
+            || get_prev(arena, block) != prev
+            || get_tree(block)->color != TREE_CHAINED) {
+            printf("bad chained block %p of tree node %p\n", block, node);
+            return -1;
+        }
+    }
+
+    int left = tree_black_height(arena, nt->left, node);
+    int right = tree_black_height(arena, nt->right, node);
+
+    if (left < 0 || left != right) {
+        printf("black heights differ below tree node %p\n", node);
+        return -1;
+    }
+
+    return left + (nt->color == TREE_BLACK);
 
 }
 
 /*
-* Detects a cycle in the doubly linked free list. 
+* Makes sure that every block on a quick list is still marked allocated, is
+* of the list's size, and that the lists add up to quick_bytes
 */
-static bool detect_cycle() {
-    
-    block_t * slow = free_start;
-    block_t * fast = free_start;
+static bool quick_lists_consistent(arena_t *arena) {
+
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < QUICK_BIN_COUNT; i++) {
+        for (block_t *block = arena->quick_lists[i]; block != NULL;
+             block = *(block_t **)block->payload) {
+
+            if (!get_alloc(block) || get_mmapped(block)
+                || get_size(block) != min_block_size + i * dsize) {
+                printf("bad quick block %p in list %zu\n", block, i);
+                return 0;
+            }
 
-    while (slow && fast && fast->next) {
-        slow = slow->next;
-        fast = fast->next->next;
-        if (slow == fast) {
-            printf("====== Found Cycle ======\n");
-            return 1;
+            bytes += get_size(block);
+            if (bytes > arena->quick_bytes) {
+                printf("quick list %zu holds too many bytes\n", i);
+                return 0;
+            }
         }
     }
-    
-    return 0;
-    
+
+    return bytes == arena->quick_bytes;
+
+}
+
+/*
+* Makes sure that every listed slab has free slots, is of the class it is
+* listed under, is marked in the slab map and counts its free slots right
+*/
+static bool slabs_consistent(arena_t *arena) {
+
+    for (size_t class = 0; class < SLAB_CLASS_COUNT; class++) {
+        slab_t *prev = NULL;
+
+        for (slab_t *slab = arena->slabs[class]; slab != NULL;
+             slab = slab->next) {
+
+            uint32_t free_count = 0;
+            for (size_t w = 0; w < SLAB_MAP_WORDS; w++) {
+                free_count += (uint32_t)__builtin_popcountll(slab->free_map[w]);
+            }
+
+            if (slab->prev != prev || slab->slab_class != class
+                || slab->free_count == 0 || free_count != slab->free_count
+                || slab_of(arena, (char *)slab + sizeof(slab_t)) != slab) {
+                printf("bad slab %p in class %zu\n", slab, class);
+                return 0;
+            }
+
+            prev = slab;
+        }
+    }
+
+    return 1;
+
 }
 
 /*
 * Makes sure that all the prev alloc bits are identical to the alloc bit of the 
-* previous block
+* previous block. Allocated blocks have no footer, so the previous block's
+* status is carried along the walk instead of being read from a footer. Where
+* the previous block is free, find_prev must also lead back to it.
 */
-static bool checkAllPrevAllocBits() {
+static bool checkAllPrevAllocBits(arena_t *arena) {
+
+    block_t * current = arena->heap_start;
+    block_t * previous = NULL;
 
-     block_t * current = heap_start;
+    // The prologue footer counts as an allocated block
+    bool actual_prev_alloc = extract_alloc(*find_prev_footer(current));
 
     size_t size = extract_size((current)->header);
     bool alloc = extract_alloc((current)->header);
@@ -1026,31 +6036,35 @@ static bool checkAllPrevAllocBits() {
     // while we haven't reached the epilogue header block
     while(!(size==0 && alloc==1)) {
 
-        bool prev_alloc;
-        if (prev_alloc_raw == 2) {
-            prev_alloc = 1;
-        } else {
-            prev_alloc = 0;
-        }
-
-        word_t * prev_footer = find_prev_footer(current);
-        bool actual_prev_alloc = extract_alloc(*prev_footer);
+        bool prev_alloc = (prev_alloc_raw != 0);
 
         if (prev_alloc != actual_prev_alloc) {
             printf("current: %p\n", current);
-            printf("prev: %p\n", find_prev(current));
+            printf("prev: %p\n", previous);
             printf("prev alloc: %d\n", prev_alloc);
             printf("actual prev alloc: %d\n", actual_prev_alloc);
             return 0;
         }
 
+        if (!prev_alloc && find_prev(current) != previous) {
+            printf("block %p does not lead back to %p\n", current, previous);
+            return 0;
+        }
+
+        actual_prev_alloc = alloc;
+        previous = current;
+
         current = find_next(current);
         size = extract_size((current)->header);
         alloc = extract_alloc((current)->header);
         prev_alloc_raw = extract_prev_alloc((current)->header);
 
     }
-    return 1;
-   
 
-}
\ No newline at end of file
+    // The epilogue header must also reflect the last block
+    if (!actual_prev_alloc && find_prev(current) != previous) {
+        return 0;
+    }
+    return (prev_alloc_raw != 0) == actual_prev_alloc;
+
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Public interface of the allocator in mm.c. Built with DRIVER defined, the
+ * allocator exports its routines under mm_ names so that a driver can run it
+ * next to the C library's malloc. Built without it, the routines take the
+ * standard names and replace malloc.
+ */
+
+extern bool mm_init(void);
+extern bool mm_checkheap(int lineno);
+
+#ifdef DRIVER
+/* declare functions for driver tests */
+extern void *mm_malloc(size_t size);
+extern void mm_free(void *ptr);
+extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+#else
+/* declare functions for interpositioning */
+extern void *malloc(size_t size);
+extern void free(void *ptr);
+extern void *realloc(void *ptr, size_t size);
+extern void *calloc(size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+#endif
+
+/* Options for mm_setopt */
+#define MM_OPT_MMAP_THRESHOLD 1 // block size from which blocks are mapped
+#define MM_OPT_DECAY_MS 2       // time a large free block waits to be purged
+#define MM_OPT_TRIM_THRESHOLD 3 // top free block size that is trimmed at once
+#define MM_OPT_PROFILE_RATE 4   // mean bytes between heap profile samples
+
+/*
+ * Purging under MM_OPT_DECAY_MS is not driven by a timer. An arena looks for
+ * decayed blocks, at most every half decay time, when it frees a heap block
+ * or has to search its free index for an allocation, so an arena that sees
+ * neither keeps its free pages until it does.
+ */
+extern bool mm_setopt(int option, size_t value);
+extern size_t mm_usable_size(void *ptr);
+
+/*
+ * Batches of same-size blocks. mm_malloc_batch stores n blocks of size bytes
+ * in out and returns how many it could allocate. mm_free_batch frees n
+ * blocks, which may come from anywhere, and reorders ptrs while at it.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/*
+ * Regions, for allocations that all die together. mm_region_alloc bumps a
+ * pointer through chunks taken from the heap, and mm_region_reset and
+ * mm_region_destroy give everything back at once. mm_region_free may give
+ * back the latest allocation early; others need no freeing.
+ */
+typedef struct mm_region mm_region_t;
+
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *region, size_t size);
+extern void mm_region_free(mm_region_t *region, void *ptr);
+extern void mm_region_reset(mm_region_t *region);
+extern void mm_region_destroy(mm_region_t *region);
+
+/*
+ * Size classes of mm_stats: class 0 holds blocks of up to 16 bytes and
+ * class k > 0 blocks of 2^(k+3) + 1 to 2^(k+4) bytes
+ */
+#define MM_STATS_CLASS_COUNT 44
+
+/*
+ * Buckets of the fit search histogram: bucket 0 counts searches that
+ * examined no candidate, bucket k > 0 those that examined 2^(k-1) to 2^k - 1
+ */
+#define MM_STATS_FIT_BUCKETS 16
+
+/*
+ * Snapshot filled in by mm_stats. A freed block counts as free wherever it
+ * waits to be handed out again: in the free index, on a quick list or in a
+ * thread cache, the last two of which cached_bytes tells apart. Slots left
+ * free inside slabs are counted in neither live_bytes nor free_bytes.
+ */
+typedef struct mm_stats
+{
+    size_t live_bytes;         // bytes in blocks handed out and not freed
+    size_t heap_bytes;         // bytes of heap regions and mapped blocks
+    size_t peak_heap_bytes;    // largest heap_bytes since mm_init
+    size_t free_blocks;        // freed blocks not handed out again
+    size_t free_bytes;         // bytes in those blocks
+    size_t cached_bytes;       // of free_bytes, in quick lists and caches
+    size_t largest_free_block; // bytes
+    double fragmentation;      // 1 - largest_free_block / free_bytes
+
+    uint64_t allocs[MM_STATS_CLASS_COUNT]; // by block size class
+    uint64_t frees[MM_STATS_CLASS_COUNT];
+    uint64_t fit_searches[MM_STATS_FIT_BUCKETS]; // by candidates examined
+    uint64_t heap_extensions;  // calls to extend_heap
+    uint64_t coalesce_merges;  // neighbours absorbed by coalesce
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+
+/*
+ * Writes the heap profile gathered while MM_OPT_PROFILE_RATE is set to path,
+ * in the heap format of gperftools that pprof reads. It holds both the live
+ * heap (pprof -inuse_space) and every allocation sampled since mm_init
+ * (pprof -alloc_space).
+ */
+extern bool mm_profile_dump(const char *path);
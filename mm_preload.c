@@ -0,0 +1,444 @@
+/*
+ * mm_preload.c - makes the allocator in mm.c the malloc of any program:
+ *
+ *   LD_PRELOAD=./libmm.so program
+ *
+ * The library is mm.c built with DRIVER, so its routines keep their mm_
+ * names, plus this file, which defines the standard entry points on top of
+ * them and initializes the heap on first use.
+ *
+ * If MM_TRACE names a file, every malloc, calloc, realloc and free is also
+ * recorded there in the binary trace format below, which mdriver replays.
+ * Each thread encodes its records into a buffer of its own and appends the
+ * buffer to the file in one write once it fills up, when the thread exits
+ * and when the process exits. A forked child stops recording. Programs
+ * started by a recording program inherit MM_TRACE; a "%p" in it stands for
+ * the process id, so that each of them writes a file of its own.
+ *
+ * Trace format: the file starts with the 8 bytes "MMTRACE1", followed by
+ * chunks. A chunk is a 4-byte little-endian byte count and that many bytes
+ * of records. A record is an operation byte followed by unsigned LEB128
+ * numbers:
+ *
+ *   'a' seq size ptr           malloc, or an aligned allocation call
+ *   'c' seq size ptr           calloc, size being the product of its
+ *                              arguments
+ *   'r' seq old_ptr size ptr   realloc
+ *   'f' seq ptr                free
+ *
+ * seq orders the records of all threads; it is taken once the call has
+ * returned, or before it starts for free, so that a block is always freed
+ * before the same address is handed out again. Pointers are stored shifted
+ * right by 4 bits, and a NULL ptr means the call failed.
+ *
+ * If MM_PROFILE names a file, the heap profiler samples one allocation per
+ * MM_PROFILE_RATE bytes on average (512 KiB unless set) and the profile is
+ * written there at process exit, for pprof. "%p" expands as in MM_TRACE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* Bytes a thread encodes before appending them to the trace */
+#define TRACE_BUFFER_SIZE 16384
+
+/* Largest encoded record: an operation byte and four 10-byte numbers */
+#define TRACE_RECORD_MAX 41
+
+static const char trace_magic[8] = "MMTRACE1";
+
+/* Mean bytes between heap profile samples unless MM_PROFILE_RATE is set */
+static const size_t profile_rate_default = (size_t)1 << 19;
+
+typedef struct trace_buffer
+{
+    unsigned char bytes[TRACE_BUFFER_SIZE];
+    size_t used;
+    bool registered; // whether the exit destructor is set for this thread
+} trace_buffer_t;
+
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+
+/* File records go to, or -1 when not recording */
+static int trace_fd = -1;
+
+/* File the heap profile is written to at exit, empty when not profiling */
+static char profile_path[PATH_MAX];
+
+/* Next record sequence number */
+static uint64_t trace_seq = 0;
+
+/* Flushes a thread's buffer when it exits */
+static pthread_key_t trace_key;
+
+static __thread trace_buffer_t trace_buffer
+    __attribute__((tls_model("initial-exec")));
+
+static void preload_init(void);
+static bool expand_path(const char *pattern, char *path, size_t size);
+static void preload_register(void) __attribute__((constructor));
+static void preload_fini(void) __attribute__((destructor));
+static void *preload_memalign(size_t alignment, size_t size);
+static trace_buffer_t *trace_local(void);
+static void trace_record(char op, uint64_t seq, uint64_t a, uint64_t b,
+                         uint64_t c, int count);
+static unsigned char *trace_encode(unsigned char *p, uint64_t value);
+static void trace_flush(trace_buffer_t *buffer);
+static void trace_thread_exit(void *arg);
+static void trace_fork_child(void);
+static uint64_t trace_next_seq(void);
+
+void *malloc(size_t size)
+{
+    pthread_once(&preload_once, preload_init);
+
+    void *ptr = mm_malloc(size);
+    if (trace_fd >= 0)
+    {
+        trace_record('a', trace_next_seq(), size, (uintptr_t)ptr >> 4, 0, 2);
+    }
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    if (trace_fd >= 0)
+    {
+        trace_record('f', trace_next_seq(), (uintptr_t)ptr >> 4, 0, 0, 1);
+    }
+    mm_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    pthread_once(&preload_once, preload_init);
+
+    void *newptr = mm_realloc(ptr, size);
+    if (trace_fd >= 0)
+    {
+        trace_record('r', trace_next_seq(), (uintptr_t)ptr >> 4, size,
+                     (uintptr_t)newptr >> 4, 3);
+    }
+    return newptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    pthread_once(&preload_once, preload_init);
+
+    void *ptr = mm_calloc(nmemb, size);
+    if (trace_fd >= 0)
+    {
+        trace_record('c', trace_next_seq(), nmemb * size,
+                     (uintptr_t)ptr >> 4, 0, 2);
+    }
+    return ptr;
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    return mm_usable_size(ptr);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    pthread_once(&preload_once, preload_init);
+
+    int error = mm_posix_memalign(memptr, alignment, size);
+    if (trace_fd >= 0 && error == 0)
+    {
+        trace_record('a', trace_next_seq(), size, (uintptr_t)*memptr >> 4, 0,
+                     2);
+    }
+    return error;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return preload_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return preload_memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return preload_memalign((size_t)getpagesize(), size);
+}
+
+/*
+ * preload_init sets up the heap, the heap profiler if MM_PROFILE is set and,
+ * if MM_TRACE is set, the trace file. It runs once, on the first allocation.
+ */
+static void preload_init(void)
+{
+    mem_init();
+    mm_init();
+
+    const char *pattern = getenv("MM_PROFILE");
+    if (pattern != NULL
+        && expand_path(pattern, profile_path, sizeof(profile_path)))
+    {
+        const char *rate = getenv("MM_PROFILE_RATE");
+        mm_setopt(MM_OPT_PROFILE_RATE, (rate != NULL)
+                  ? (size_t)strtoull(rate, NULL, 10) : profile_rate_default);
+    }
+    else
+    {
+        profile_path[0] = '\0';
+    }
+
+    pattern = getenv("MM_TRACE");
+    char path[PATH_MAX];
+    if (pattern == NULL || !expand_path(pattern, path, sizeof(path)))
+    {
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  0644);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    if (write(fd, trace_magic, sizeof(trace_magic))
+        != (ssize_t)sizeof(trace_magic)
+        || pthread_key_create(&trace_key, trace_thread_exit) != 0)
+    {
+        close(fd);
+        return;
+    }
+
+    trace_fd = fd;
+}
+
+/*
+ * expand_path expands an MM_TRACE or MM_PROFILE pattern into path, replacing
+ * "%p" with the process id. Formats by hand, since the C library may
+ * allocate.
+ */
+static bool expand_path(const char *pattern, char *path, size_t size)
+{
+    char pid[24];
+    size_t pid_length = 0;
+    size_t length = 0;
+
+    for (unsigned long n = (unsigned long)getpid(); n > 0 || pid_length == 0;
+         n /= 10)
+    {
+        pid[pid_length++] = (char)('0' + n % 10);
+    }
+
+    for (const char *p = pattern; *p != '\0'; p++)
+    {
+        if (p[0] == '%' && p[1] == 'p')
+        {
+            if (length + pid_length >= size)
+            {
+                return false;
+            }
+            for (size_t i = pid_length; i > 0; i--)
+            {
+                path[length++] = pid[i - 1];
+            }
+            p++;
+            continue;
+        }
+
+        if (length + 1 >= size)
+        {
+            return false;
+        }
+        path[length++] = *p;
+    }
+
+    path[length] = '\0';
+    return length > 0;
+}
+
+/*
+ * preload_register installs the child fork handler when the library is
+ * loaded. pthread_atfork may allocate, so preload_init cannot do it.
+ */
+static void preload_register(void)
+{
+    pthread_atfork(NULL, NULL, trace_fork_child);
+}
+
+/*
+ * preload_fini writes out what the exiting thread has buffered, and the heap
+ * profile
+ */
+static void preload_fini(void)
+{
+    if (trace_fd >= 0)
+    {
+        trace_flush(&trace_buffer);
+    }
+    if (profile_path[0] != '\0')
+    {
+        mm_profile_dump(profile_path);
+    }
+}
+
+/*
+ * preload_memalign serves the aligned allocation calls that return the
+ * block. The trace records them as mallocs, since a replay needs no
+ * alignment.
+ */
+static void *preload_memalign(size_t alignment, size_t size)
+{
+    pthread_once(&preload_once, preload_init);
+
+    void *ptr = mm_memalign(alignment, size);
+    if (trace_fd >= 0)
+    {
+        trace_record('a', trace_next_seq(), size, (uintptr_t)ptr >> 4, 0, 2);
+    }
+    return ptr;
+}
+
+/*
+ * trace_local returns the calling thread's buffer, registering the exit
+ * destructor that flushes it on first use
+ */
+static trace_buffer_t *trace_local(void)
+{
+    trace_buffer_t *buffer = &trace_buffer;
+
+    if (!buffer->registered)
+    {
+        // pthread_setspecific may allocate, which records and comes back here
+        buffer->registered = true;
+        pthread_setspecific(trace_key, buffer);
+    }
+    return buffer;
+}
+
+/*
+ * trace_record appends one record with count numbers after seq to the
+ * calling thread's buffer
+ */
+static void trace_record(char op, uint64_t seq, uint64_t a, uint64_t b,
+                         uint64_t c, int count)
+{
+    trace_buffer_t *buffer = trace_local();
+
+    if (buffer->used + TRACE_RECORD_MAX > TRACE_BUFFER_SIZE)
+    {
+        trace_flush(buffer);
+    }
+
+    unsigned char *p = buffer->bytes + buffer->used;
+    *p++ = (unsigned char)op;
+    p = trace_encode(p, seq);
+    p = trace_encode(p, a);
+    if (count > 1)
+    {
+        p = trace_encode(p, b);
+    }
+    if (count > 2)
+    {
+        p = trace_encode(p, c);
+    }
+    buffer->used = (size_t)(p - buffer->bytes);
+}
+
+/*
+ * trace_encode writes value as unsigned LEB128 and returns the byte after it
+ */
+static unsigned char *trace_encode(unsigned char *p, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+/*
+ * trace_flush appends a buffer to the trace as one chunk. A single writev
+ * to a file opened with O_APPEND keeps the chunks of threads whole.
+ */
+static void trace_flush(trace_buffer_t *buffer)
+{
+    unsigned char header[4];
+    uint32_t length = (uint32_t)buffer->used;
+    int fd = trace_fd;
+
+    if (length == 0 || fd < 0)
+    {
+        buffer->used = 0;
+        return;
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        header[i] = (unsigned char)(length >> (8 * i));
+    }
+
+    struct iovec parts[2] = {
+        {header, sizeof(header)},
+        {buffer->bytes, length},
+    };
+    if (writev(fd, parts, 2) < 0)
+    {
+        trace_fd = -1;
+    }
+    buffer->used = 0;
+}
+
+/*
+ * trace_thread_exit flushes the buffer of an exiting thread
+ */
+static void trace_thread_exit(void *arg)
+{
+    trace_buffer_t *buffer = arg;
+
+    trace_flush(buffer);
+    buffer->registered = false;
+}
+
+/*
+ * trace_fork_child stops recording in a forked child. The records buffered
+ * by the forking thread belong to the parent, which writes them.
+ */
+static void trace_fork_child(void)
+{
+    int fd = trace_fd;
+
+    trace_fd = -1;
+    trace_buffer.used = 0;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/*
+ * trace_next_seq hands out record sequence numbers
+ */
+static uint64_t trace_next_seq(void)
+{
+    return __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,486 @@
+/*
+ * mmcheck.c - checks the entry points of the allocator in mm.c that the
+ * traces replayed by mdriver do not reach. Each check starts on a fresh
+ * heap, fills every block it gets across its whole usable size, verifies
+ * the fill before giving blocks back, and runs mm_checkheap after each step.
+ *
+ * usage: mmcheck [check...]
+ *
+ * Without arguments every check runs. Prints one line per check and exits
+ * with status 1 if any failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* A check and the function that runs it */
+typedef struct
+{
+    const char *name;
+    bool (*body)(void);
+} check_t;
+
+static bool check_batch(void);
+static bool check_aligned(void);
+static bool check_region(void);
+
+static const check_t checks[] = {
+    {"batch", check_batch},
+    {"aligned", check_aligned},
+    {"region", check_region},
+};
+
+#define CHECK_COUNT (sizeof(checks) / sizeof(checks[0]))
+
+/* batch: blocks per heap batch, and sizes of slab slots and mapped blocks */
+#define BATCH_BLOCKS 64
+static const size_t batch_size = 200;
+static const size_t batch_slab_size = 32;
+static const size_t batch_mapped_size = (size_t)2 << 20;
+
+/* aligned: alignments tried, and the size of the mapped blocks */
+static const size_t aligned_min = 32;
+static const size_t aligned_max = (size_t)1 << 16;
+static const size_t aligned_mapped_size = (size_t)3 << 20;
+
+/* region: allocations per round, and the size of the first one */
+#define REGION_BLOCKS 2000
+static const size_t region_first_size = (size_t)10000;
+
+/* Name of the check running, for failure messages */
+static const char *current = "";
+
+static bool run(const check_t *check);
+static bool expect(bool ok, const char *what);
+static bool heap_ok(const char *step);
+static void fill(void *bp, unsigned char tag);
+static bool intact(void *bp, unsigned char tag);
+static void shuffle(void **ptrs, size_t n, uint64_t seed);
+static void *batch_thread(void *arg);
+static bool aligned_block_ok(void *bp, size_t align, size_t size,
+                             unsigned char tag);
+static bool region_round(mm_region_t *region, uint64_t seed);
+
+int main(int argc, char **argv)
+{
+    bool ok = true;
+
+    mem_init();
+
+    for (size_t i = 0; i < CHECK_COUNT; i++)
+    {
+        bool wanted = (argc < 2);
+        for (int a = 1; a < argc; a++)
+        {
+            wanted = wanted || strcmp(argv[a], checks[i].name) == 0;
+        }
+        if (wanted)
+        {
+            ok = run(&checks[i]) && ok;
+        }
+    }
+
+    mem_deinit();
+    return ok ? 0 : 1;
+}
+
+/*
+ * run starts a check on a fresh heap and reports how it went
+ */
+static bool run(const check_t *check)
+{
+    current = check->name;
+    mem_reset_brk();
+
+    bool ok = mm_init() && check->body();
+    printf("%-12s %s\n", check->name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/*
+ * expect reports what went wrong unless ok
+ */
+static bool expect(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("%s: %s\n", current, what);
+    }
+    return ok;
+}
+
+/*
+ * heap_ok runs mm_checkheap after step
+ */
+static bool heap_ok(const char *step)
+{
+    if (!mm_checkheap(__LINE__))
+    {
+        printf("%s: heap inconsistent after %s\n", current, step);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * fill writes tag over the whole usable size of the block at bp
+ */
+static void fill(void *bp, unsigned char tag)
+{
+    memset(bp, tag, mm_usable_size(bp));
+}
+
+/*
+ * intact returns whether the block at bp still holds the fill of tag
+ */
+static bool intact(void *bp, unsigned char tag)
+{
+    unsigned char *p = bp;
+    size_t size = mm_usable_size(bp);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (p[i] != tag)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * shuffle puts ptrs in a random order drawn from seed
+ */
+static void shuffle(void **ptrs, size_t n, uint64_t seed)
+{
+    for (size_t i = n; i > 1; i--)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t j = (size_t)(seed >> 33) % i;
+        void *tmp = ptrs[i - 1];
+        ptrs[i - 1] = ptrs[j];
+        ptrs[j] = tmp;
+    }
+}
+
+/*
+ * batch_thread allocates a heap batch from the arena of a thread of its own,
+ * which differs from the caller's whenever there is more than one arena
+ */
+static void *batch_thread(void *arg)
+{
+    void **out = arg;
+    return (void *)(uintptr_t)mm_malloc_batch(batch_size, BATCH_BLOCKS, out);
+}
+
+/*
+ * check_batch carves a batch of neighbouring heap blocks and checks that
+ * filling each one leaves the others alone, then frees it together with
+ * slab slots, mapped blocks and another thread's batch, all shuffled
+ */
+static bool check_batch(void)
+{
+    void *ptrs[4 * BATCH_BLOCKS];
+    size_t n = 0;
+    bool ok = true;
+
+    n += mm_malloc_batch(batch_size, BATCH_BLOCKS, ptrs + n);
+    ok = expect(n == BATCH_BLOCKS, "heap batch came up short") && ok;
+    ok = heap_ok("mm_malloc_batch") && ok;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        ok = expect(((uintptr_t)ptrs[i] & 15) == 0, "misaligned block") && ok;
+        ok = expect(mm_usable_size(ptrs[i]) >= batch_size, "block too small")
+             && ok;
+        fill(ptrs[i], (unsigned char)i);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        ok = expect(intact(ptrs[i], (unsigned char)i),
+                    "block overwritten by a neighbour") && ok;
+    }
+    ok = heap_ok("filling the batch") && ok;
+
+    size_t got = mm_malloc_batch(batch_slab_size, BATCH_BLOCKS / 2, ptrs + n);
+    ok = expect(got == BATCH_BLOCKS / 2, "slab batch came up short") && ok;
+    n += got;
+
+    got = mm_malloc_batch(batch_mapped_size, 2, ptrs + n);
+    ok = expect(got == 2, "mapped batch came up short") && ok;
+    n += got;
+
+    pthread_t thread;
+    void *result = NULL;
+    if (pthread_create(&thread, NULL, batch_thread, ptrs + n) == 0)
+    {
+        pthread_join(thread, &result);
+    }
+    got = (size_t)(uintptr_t)result;
+    ok = expect(got == BATCH_BLOCKS, "other thread's batch came up short")
+         && ok;
+    n += got;
+
+    for (size_t i = BATCH_BLOCKS; i < n; i++)
+    {
+        fill(ptrs[i], (unsigned char)i);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        ok = expect(intact(ptrs[i], (unsigned char)i),
+                    "block overwritten before mm_free_batch") && ok;
+    }
+    ok = heap_ok("the mixed batches") && ok;
+
+    shuffle(ptrs, n, 21);
+    mm_free_batch(ptrs, n);
+    ok = heap_ok("mm_free_batch") && ok;
+
+    // The freed memory is usable again
+    void *bp = mm_malloc(BATCH_BLOCKS * batch_size);
+    ok = expect(bp != NULL, "malloc after mm_free_batch failed") && ok;
+    mm_free(bp);
+    ok = heap_ok("reuse") && ok;
+
+    return ok;
+}
+
+/*
+ * aligned_block_ok checks the alignment and usable size of an aligned block
+ * and fills it with tag
+ */
+static bool aligned_block_ok(void *bp, size_t align, size_t size,
+                             unsigned char tag)
+{
+    bool ok = expect(bp != NULL, "aligned allocation failed");
+    if (bp == NULL)
+    {
+        return false;
+    }
+
+    ok = expect(((uintptr_t)bp & (align - 1)) == 0, "block misaligned") && ok;
+    ok = expect(mm_usable_size(bp) >= size, "block too small") && ok;
+    fill(bp, tag);
+    return ok;
+}
+
+/*
+ * check_aligned allocates heap and mapped blocks at every alignment through
+ * each entry point, checks the errors for bad alignments, and reallocs and
+ * frees the blocks
+ */
+static bool check_aligned(void)
+{
+    void *ptrs[64];
+    size_t n = 0;
+    bool ok = true;
+
+    // Bad alignments fail and leave *memptr alone
+    void *bp = &bp;
+    errno = 0;
+    ok = expect(mm_memalign(48, 100) == NULL && errno == EINVAL,
+                "memalign took an alignment of 48") && ok;
+    ok = expect(mm_posix_memalign(&bp, 48, 100) == EINVAL,
+                "posix_memalign took an alignment of 48") && ok;
+    ok = expect(mm_posix_memalign(&bp, sizeof(void *) / 2, 100) == EINVAL,
+                "posix_memalign took an alignment below sizeof(void *)")
+         && ok;
+    ok = expect(mm_posix_memalign(&bp, 0, 100) == EINVAL,
+                "posix_memalign took an alignment of 0") && ok;
+    ok = expect(bp == &bp, "posix_memalign changed *memptr on failure") && ok;
+
+    // Heap blocks, with small blocks in between to split the slack off
+    for (size_t align = aligned_min; align <= aligned_max; align *= 2)
+    {
+        size_t size = align / 2 + 40;
+
+        ptrs[n] = mm_memalign(align, size);
+        ok = aligned_block_ok(ptrs[n], align, size, (unsigned char)n) && ok;
+        n++;
+
+        ptrs[n] = mm_malloc(24);
+        ok = aligned_block_ok(ptrs[n], 16, 24, (unsigned char)n) && ok;
+        n++;
+
+        ptrs[n] = mm_aligned_alloc(align, 3 * size);
+        ok = aligned_block_ok(ptrs[n], align, 3 * size, (unsigned char)n)
+             && ok;
+        n++;
+
+        ptrs[n] = NULL;
+        ok = expect(mm_posix_memalign(&ptrs[n], align, size) == 0,
+                    "posix_memalign failed") && ok;
+        ok = aligned_block_ok(ptrs[n], align, size, (unsigned char)n) && ok;
+        n++;
+    }
+    ok = heap_ok("aligned heap blocks") && ok;
+
+    // Mapped blocks, whose mapping starts before the header by the lead
+    // stored in the word ahead of it
+    size_t page = (size_t)getpagesize();
+    size_t first_mapped = n;
+    for (size_t align = page; align <= ((size_t)1 << 21); align *= 8)
+    {
+        ptrs[n] = mm_memalign(align, aligned_mapped_size);
+        ok = aligned_block_ok(ptrs[n], align, aligned_mapped_size,
+                              (unsigned char)n) && ok;
+        if (ptrs[n] != NULL)
+        {
+            uint64_t lead = ((uint64_t *)ptrs[n])[-2];
+            char *start = (char *)ptrs[n] - 2 * sizeof(uint64_t) - lead;
+            ok = expect(lead < page && ((uintptr_t)start & (page - 1)) == 0,
+                        "mapped block has a bad lead") && ok;
+        }
+        n++;
+    }
+    ok = heap_ok("aligned mapped blocks") && ok;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        ok = expect(ptrs[i] != NULL && intact(ptrs[i], (unsigned char)i),
+                    "aligned block overwritten") && ok;
+    }
+
+    // realloc keeps the contents, in place or not
+    for (size_t i = 0; i < n; i += 2)
+    {
+        size_t old = mm_usable_size(ptrs[i]);
+        size_t size = (i >= first_mapped) ? 2 * aligned_mapped_size
+                                          : old + 1000;
+        void *newptr = mm_realloc(ptrs[i], size);
+
+        ok = expect(newptr != NULL, "realloc of an aligned block failed")
+             && ok;
+        if (newptr == NULL)
+        {
+            continue;
+        }
+
+        unsigned char *p = newptr;
+        bool kept = true;
+        for (size_t k = 0; k < old; k++)
+        {
+            kept = kept && p[k] == (unsigned char)i;
+        }
+        ok = expect(kept, "realloc lost an aligned block's contents") && ok;
+        ptrs[i] = newptr;
+        fill(ptrs[i], (unsigned char)i);
+        ok = heap_ok("realloc of an aligned block") && ok;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        ok = expect(intact(ptrs[i], (unsigned char)i),
+                    "aligned block overwritten after realloc") && ok;
+        mm_free(ptrs[i]);
+        ok = heap_ok("free of an aligned block") && ok;
+    }
+
+    return ok;
+}
+
+/*
+ * region_round fills a region with blocks of sizes drawn from seed, with a
+ * few large enough for chunks of their own, and checks that none overlap
+ */
+static bool region_round(mm_region_t *region, uint64_t seed)
+{
+    static unsigned char *blocks[REGION_BLOCKS];
+    static size_t sizes[REGION_BLOCKS];
+    bool ok = true;
+
+    for (size_t i = 0; i < REGION_BLOCKS; i++)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        sizes[i] = (i % 100 == 99) ? 50000 + (seed >> 48)
+                                   : 1 + (size_t)(seed >> 55);
+        blocks[i] = mm_region_alloc(region, sizes[i]);
+        if (!expect(blocks[i] != NULL, "mm_region_alloc failed"))
+        {
+            return false;
+        }
+        ok = expect(((uintptr_t)blocks[i] & 15) == 0, "misaligned block")
+             && ok;
+        memset(blocks[i], (unsigned char)i, sizes[i]);
+    }
+
+    for (size_t i = 0; i < REGION_BLOCKS; i++)
+    {
+        bool kept = true;
+        for (size_t k = 0; k < sizes[i]; k++)
+        {
+            kept = kept && blocks[i][k] == (unsigned char)i;
+        }
+        ok = expect(kept, "region block overwritten") && ok;
+    }
+    return ok;
+}
+
+/*
+ * check_region starts a region with a chunk of its own, undoes allocations
+ * with mm_region_free, and fills, resets and refills the region before
+ * destroying it
+ */
+static bool check_region(void)
+{
+    bool ok = true;
+
+    mm_region_t *region = mm_region_create();
+    if (!expect(region != NULL, "mm_region_create failed"))
+    {
+        return false;
+    }
+
+    // The first request is large enough for a chunk of its own, which the
+    // reset then keeps for the allocations that follow
+    char *first = mm_region_alloc(region, region_first_size);
+    ok = expect(first != NULL, "first mm_region_alloc failed") && ok;
+    memset(first, 1, region_first_size);
+    ok = heap_ok("the first region allocation") && ok;
+
+    mm_region_reset(region);
+    ok = heap_ok("resetting the first chunk") && ok;
+    char *small = mm_region_alloc(region, 100);
+    ok = expect(small == first, "reset did not keep the first chunk") && ok;
+
+    // Only the latest allocation can be given back early
+    char *a = mm_region_alloc(region, 64);
+    char *b = mm_region_alloc(region, 64);
+    mm_region_free(region, b);
+    ok = expect(mm_region_alloc(region, 64) == b,
+                "mm_region_free did not give back the latest block") && ok;
+    mm_region_free(region, a);
+    char *c = mm_region_alloc(region, 64);
+    ok = expect(c != a && c != b, "mm_region_free gave back an older block")
+         && ok;
+    ok = heap_ok("mm_region_free") && ok;
+
+    for (uint64_t round = 0; round < 4; round++)
+    {
+        ok = region_round(region, round) && ok;
+        ok = heap_ok("filling the region") && ok;
+
+        mm_region_reset(region);
+        ok = heap_ok("mm_region_reset") && ok;
+    }
+
+    // Heap allocations in between are unaffected
+    void *bp = mm_malloc(5000);
+    fill(bp, 7);
+    ok = region_round(region, 9) && ok;
+    ok = expect(intact(bp, 7), "region overwrote a heap block") && ok;
+    mm_free(bp);
+
+    mm_region_destroy(region);
+    ok = heap_ok("mm_region_destroy") && ok;
+
+    return ok;
+}
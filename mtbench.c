@@ -0,0 +1,444 @@
+/*
+ * mtbench.c - runs classic multithreaded allocator workloads against the
+ * allocator in mm.c at 1 to N threads, and reports operations per second,
+ * scaling efficiency and peak resident set for each thread count.
+ *
+ * usage: mtbench [-t max_threads] [-n ops] [-w workload]
+ *
+ *   -t max_threads  largest thread count (default: online CPUs)
+ *   -n ops          operations per thread (default 1000000)
+ *   -w workload     only run larson, threadtest or prodcons
+ *
+ * Workloads:
+ *   larson      each thread replaces random blocks of its own set with new
+ *               blocks of random size; between rounds the sets move on to
+ *               the next thread, so blocks are freed by threads that did
+ *               not allocate them (server churn)
+ *   threadtest  each thread allocates a batch of equal blocks and then
+ *               frees the whole batch
+ *   prodcons    producer threads allocate blocks and hand them through a
+ *               queue to consumer threads, which free them; a thread count
+ *               of n means n/2 pairs (at least one)
+ *
+ * Each malloc and each free counts as one operation. The efficiency at n
+ * threads is its throughput over n times the single-thread throughput.
+ * Every run happens in a child process of its own, so the peak resident
+ * set is that of the run alone.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "benchlib.h"
+
+/* A workload and the body its threads run */
+typedef struct
+{
+    const char *name;
+    void *(*body)(void *arg);
+} workload_t;
+
+/* Per-thread arguments */
+typedef struct
+{
+    unsigned index;
+    unsigned threads;
+    size_t ops;
+    uint64_t seed;
+    uint64_t done; // operations performed
+} worker_t;
+
+/* What a child reports back about one run */
+typedef struct
+{
+    bool ok;
+    double seconds;
+    uint64_t ops;
+    size_t peak_kb;
+} result_t;
+
+static void *larson_body(void *arg);
+static void *threadtest_body(void *arg);
+static void *prodcons_body(void *arg);
+
+static const workload_t workloads[] = {
+    {"larson", larson_body},
+    {"threadtest", threadtest_body},
+    {"prodcons", prodcons_body},
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+/* larson: blocks per set, size range and replacements per round */
+#define LARSON_SLOTS 1000
+static const size_t larson_min_size = 16;
+static const size_t larson_max_size = 1024;
+static const size_t larson_round_ops = 10000;
+
+/* threadtest: batch length and block size */
+#define THREADTEST_BATCH 1000
+static const size_t threadtest_size = 64;
+
+/* prodcons: queue length and block size range */
+#define QUEUE_SIZE 1024
+static const size_t prodcons_min_size = 16;
+static const size_t prodcons_max_size = 512;
+
+/* larson sets; in round r, thread i works on set (i + r) % threads */
+static void **larson_sets[64];
+static pthread_barrier_t larson_barrier;
+
+/* prodcons: one single-producer single-consumer ring per pair */
+typedef struct
+{
+    void *slots[QUEUE_SIZE];
+    size_t head; // next slot the consumer takes
+    size_t tail; // next slot the producer fills
+} __attribute__((aligned(64))) queue_t;
+
+static queue_t *queues;
+
+static bool run(const workload_t *workload, unsigned threads, size_t ops,
+                result_t *result);
+static bool run_child(const workload_t *workload, unsigned threads,
+                      size_t ops, result_t *result);
+static uint64_t next_random(uint64_t *state);
+static size_t random_size(uint64_t *state, size_t lo, size_t hi);
+static void usage(const char *prog);
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned max_threads = (cpus < 1) ? 1 : (unsigned)cpus;
+    size_t ops = 1000000;
+    const char *only = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:w:h")) != -1)
+    {
+        switch (c)
+        {
+        case 't':
+            max_threads = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (max_threads == 0 || max_threads > 64 || ops == 0)
+    {
+        usage(argv[0]);
+    }
+
+    mem_init();
+
+    printf("%-12s %8s %14s %10s %12s\n", "workload", "threads", "ops/s",
+           "scaling", "peak KiB");
+
+    bool failed = false;
+    for (size_t w = 0; w < WORKLOAD_COUNT; w++)
+    {
+        const workload_t *workload = &workloads[w];
+        double single = 0;
+
+        if (only != NULL && strcmp(only, workload->name) != 0)
+        {
+            continue;
+        }
+
+        for (unsigned threads = 1; threads <= max_threads; threads++)
+        {
+            result_t result;
+
+            if (!run(workload, threads, ops, &result) || !result.ok)
+            {
+                printf("%-12s %8u %14s\n", workload->name, threads,
+                       "FAILED");
+                failed = true;
+                continue;
+            }
+
+            double rate = result.ops / result.seconds;
+            if (threads == 1)
+            {
+                single = rate;
+            }
+
+            printf("%-12s %8u %14.0f", workload->name, threads, rate);
+            if (single > 0)
+            {
+                printf(" %9.1f%%", 100.0 * rate / (threads * single));
+            }
+            else
+            {
+                printf(" %10s", "-");
+            }
+            printf(" %12zu\n", result.peak_kb);
+        }
+    }
+
+    mem_deinit();
+    return failed ? 1 : 0;
+}
+
+/*
+ * run forks a child that performs one run and collects its result
+ */
+static bool run(const workload_t *workload, unsigned threads, size_t ops,
+                result_t *result)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        result_t child;
+
+        close(fds[0]);
+        child.ok = run_child(workload, threads, ops, &child);
+        if (write(fds[1], &child, sizeof(child)) != sizeof(child))
+        {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    return got == (ssize_t)sizeof(*result) && WIFEXITED(status)
+           && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * run_child starts the workload's threads on a fresh heap and times them
+ */
+static bool run_child(const workload_t *workload, unsigned threads,
+                      size_t ops, result_t *result)
+{
+    pthread_t tids[128];
+    worker_t workers[128];
+    unsigned count = threads;
+
+    mem_reset_brk();
+    if (!mm_init())
+    {
+        return false;
+    }
+
+    if (workload->body == larson_body)
+    {
+        pthread_barrier_init(&larson_barrier, NULL, threads);
+        for (unsigned i = 0; i < threads; i++)
+        {
+            larson_sets[i] = calloc(LARSON_SLOTS, sizeof(void *));
+        }
+    }
+    else if (workload->body == prodcons_body)
+    {
+        unsigned pairs = (threads / 2 > 0) ? threads / 2 : 1;
+        count = 2 * pairs;
+        queues = calloc(pairs, sizeof(queue_t));
+    }
+
+    double start = now_seconds();
+    for (unsigned i = 0; i < count; i++)
+    {
+        workers[i] = (worker_t){i, count, ops, 0x9e3779b97f4a7c15ULL * (i + 1),
+                                0};
+        if (pthread_create(&tids[i], NULL, workload->body, &workers[i]) != 0)
+        {
+            return false;
+        }
+    }
+
+    result->ops = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        pthread_join(tids[i], NULL);
+        result->ops += workers[i].done;
+    }
+    result->seconds = now_seconds() - start;
+    result->peak_kb = read_status_kb("VmHWM:");
+
+    return true;
+}
+
+/*
+ * larson_body replaces random blocks of the thread's current set, passing
+ * the set on to the next thread every larson_round_ops replacements
+ */
+static void *larson_body(void *arg)
+{
+    worker_t *worker = arg;
+    unsigned set = worker->index;
+
+    void **slots = larson_sets[set];
+    for (size_t i = 0; i < LARSON_SLOTS; i++)
+    {
+        slots[i] = mm_malloc(random_size(&worker->seed, larson_min_size,
+                                         larson_max_size));
+        worker->done++;
+    }
+
+    for (size_t op = 0; op < worker->ops; op += 2)
+    {
+        if (op % larson_round_ops == 0 && op > 0)
+        {
+            // Wait until no thread uses the set this one moves on to
+            pthread_barrier_wait(&larson_barrier);
+            set = (set + 1) % worker->threads;
+            slots = larson_sets[set];
+        }
+
+        size_t i = next_random(&worker->seed) % LARSON_SLOTS;
+        mm_free(slots[i]);
+        slots[i] = mm_malloc(random_size(&worker->seed, larson_min_size,
+                                         larson_max_size));
+        *(char *)slots[i] = 1;
+        worker->done += 2;
+    }
+
+    for (size_t i = 0; i < LARSON_SLOTS; i++)
+    {
+        mm_free(slots[i]);
+        worker->done++;
+    }
+
+    return NULL;
+}
+
+/*
+ * threadtest_body allocates and frees batches of equal blocks
+ */
+static void *threadtest_body(void *arg)
+{
+    worker_t *worker = arg;
+    void *batch[THREADTEST_BATCH];
+
+    for (size_t op = 0; op < worker->ops; op += 2 * THREADTEST_BATCH)
+    {
+        for (size_t i = 0; i < THREADTEST_BATCH; i++)
+        {
+            batch[i] = mm_malloc(threadtest_size);
+            *(char *)batch[i] = 1;
+        }
+        for (size_t i = 0; i < THREADTEST_BATCH; i++)
+        {
+            mm_free(batch[i]);
+        }
+        worker->done += 2 * THREADTEST_BATCH;
+    }
+
+    return NULL;
+}
+
+/*
+ * prodcons_body is a producer for even indices and the matching consumer
+ * for odd ones. Each producer makes ops / 2 blocks.
+ */
+static void *prodcons_body(void *arg)
+{
+    worker_t *worker = arg;
+    queue_t *queue = &queues[worker->index / 2];
+    size_t count = worker->ops / 2;
+
+    if (worker->index % 2 == 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            void *p = mm_malloc(random_size(&worker->seed, prodcons_min_size,
+                                            prodcons_max_size));
+            *(char *)p = 1;
+
+            size_t tail = queue->tail;
+            while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)
+                   == QUEUE_SIZE)
+            {
+                sched_yield();
+            }
+            queue->slots[tail % QUEUE_SIZE] = p;
+            __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t head = queue->head;
+            while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == head)
+            {
+                sched_yield();
+            }
+            mm_free(queue->slots[head % QUEUE_SIZE]);
+            __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    worker->done = count;
+    return NULL;
+}
+
+/*
+ * next_random advances an xorshift64* generator
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * random_size picks a size in [lo, hi]
+ */
+static size_t random_size(uint64_t *state, size_t lo, size_t hi)
+{
+    return lo + next_random(state) % (hi - lo + 1);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t max_threads] [-n ops] "
+            "[-w larson|threadtest|prodcons]\n", prog);
+    exit(2);
+}